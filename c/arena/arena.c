@@ -0,0 +1,75 @@
+#include "arena.h"
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t      size;
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+// Start a new chunk that fits at least size bytes
+static int arena_grow(Arena *arena, size_t size) {
+    size_t chunk_size = ARENA_HEADER_SIZE + size;
+    if (chunk_size < ARENA_CHUNK_SIZE) {
+        chunk_size = ARENA_CHUNK_SIZE;
+    }
+
+    ArenaChunk *chunk = (ArenaChunk *)malloc(chunk_size);
+    if (!chunk) {
+        return -1;
+    }
+    chunk->size   = chunk_size;
+    chunk->next   = arena->chunks;
+    arena->chunks = chunk;
+    arena->ptr    = (char *)chunk + ARENA_HEADER_SIZE;
+    arena->end    = (char *)chunk + chunk_size;
+    return 0;
+}
+
+// Allocate size bytes aligned for any scalar type
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (size == 0) {
+        size = ARENA_ALIGNMENT;
+    }
+    if (!arena->ptr || (size_t)(arena->end - arena->ptr) < size) {
+        if (arena_grow(arena, size) != 0) {
+            return NULL;
+        }
+    }
+    void *result = arena->ptr;
+    arena->ptr += size;
+    return result;
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size) {
+    if (size && count > (size_t)-1 / size) {
+        return NULL;
+    }
+    void *result = arena_alloc(arena, count * size);
+    if (result) {
+        memset(result, 0, count * size);
+    }
+    return result;
+}
+
+char *arena_memdup(Arena *arena, const void *src, size_t size) {
+    char *result = (char *)arena_alloc(arena, size);
+    if (result && size) {
+        memcpy(result, src, size);
+    }
+    return result;
+}
+
+// Release every allocation of the arena
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->ptr    = NULL;
+    arena->end    = NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT  (sizeof(void *) > sizeof(double) ? sizeof(void *) : sizeof(double))
+
+typedef struct ArenaChunk ArenaChunk;
+
+// Bump allocator. Allocations are carved out of large chunks in order and
+// are only released all at once by arena_free(). A zeroed Arena is ready to
+// use.
+typedef struct Arena {
+    ArenaChunk *chunks;
+    char       *ptr;
+    char       *end;
+} Arena;
+
+// Function prototypes
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+char *arena_memdup(Arena *arena, const void *src, size_t size);
+void  arena_free(Arena *arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,214 @@
+// Microbenchmarks of the hot paths of cr, on each doc given:
+//
+//   bench DOC...
+//
+// Each benchmark prints one JSON object per line, with the mean time of an
+// iteration in ns, so runs can be compared by a script.
+
+#define main cr_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+#define MIN_NS 2e8 // Run each benchmark for at least this long
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Run fn until MIN_NS passed, doubling the iterations of each round, and
+// report the mean of the last round
+static void bench(const char *name, const char *doc_path, void (*fn)(void *), void *arg) {
+    long   iterations = 1;
+    double elapsed    = 0;
+    fn(arg);
+    for (;;) {
+        double start = now_ns();
+        for (long i = 0; i < iterations; i++) {
+            fn(arg);
+        }
+        elapsed = now_ns() - start;
+        if (elapsed >= MIN_NS || iterations >= (1L << 30)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    printf("{\"name\":\"%s\",\"doc\":\"%s\",\"iterations\":%ld,\"ns_per_op\":%.1f}\n", name, doc_path, iterations,
+           elapsed / (double)iterations);
+    fflush(stdout);
+}
+
+typedef struct {
+    char     *path;
+    MD_DOC    doc;   // Parsed once for the benchmarks of the tree
+    STR_VIEW  code;  // Largest code block of the doc
+    char     *lines; // Copy of code, which md4c would hand over in pieces
+    FILE     *null;
+    volatile long sink;
+} BENCH;
+
+static void bench_parse(void *arg) {
+    BENCH *b   = arg;
+    MD_DOC doc = {0};
+    if (!parse_file(b->path, &doc, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    free_doc(&doc);
+}
+
+static void bench_parse_md4c(void *arg) {
+    config.fast_scan = 0;
+    bench_parse(arg);
+}
+
+static void bench_parse_scan(void *arg) {
+    config.fast_scan = 1;
+    bench_parse(arg);
+    config.fast_scan = 0;
+}
+
+// Feed the lines of text to text_callback as md4c does for a code block:
+// each line, then a static "\n"
+static void feed_lines(BENCH *b, const char *text, size_t size) {
+    CallbackData data = {.doc = b->doc.map, .doc_size = b->doc.map_size, .block_type = MD_BLOCK_CODE};
+    for (const char *line = text; line < text + size;) {
+        const char *end = memchr(line, '\n', (size_t)(text + size - line));
+        end             = end ? end : text + size;
+        text_callback(MD_TEXT_CODE, line, (MD_SIZE)(end - line), &data);
+        text_callback(MD_TEXT_CODE, "\n", 1, &data);
+        line = end + 1;
+    }
+    b->sink += (long)data.content.size;
+    free(data.buffer);
+}
+
+// Lines in the doc, which extend one view
+static void bench_text_view(void *arg) {
+    BENCH *b = arg;
+    feed_lines(b, b->code.text, b->code.size);
+}
+
+// Lines outside of the doc, which are copied into the buffer
+static void bench_text_buffer(void *arg) {
+    BENCH *b = arg;
+    feed_lines(b, b->lines, b->code.size);
+}
+
+static void bench_find_node(void *arg) {
+    BENCH *b = arg;
+    b->sink += (long)(size_t)find_node(&b->doc, "last");
+}
+
+static void bench_find_path(void *arg) {
+    BENCH *b = arg;
+    b->sink += (long)(size_t)find_node(&b->doc, "bench/last");
+}
+
+static void bench_get_executor(void *arg) {
+    BENCH *b = arg;
+    b->sink += (long)(size_t)get_executor(str_view("sh"));
+    b->sink += (long)(size_t)get_executor(str_view("python"));
+    b->sink += (long)(size_t)get_executor(str_view("bench"));
+}
+
+static void bench_build_exec_args(void *arg) {
+    static const char *template_args[] = {"sh", "-c", "{CODE} && echo {LANG}:{CODE}", "{LANG}"};
+    static char       *args[]          = {"a", "b"};
+
+    BENCH     *b          = arg;
+    CODE_BLOCK block      = {.info = str_view("sh"), .code = b->code};
+    CODE_INPUT input      = {.file_fd = -1};
+    EXEC_ARGS  exec_args;
+    if (build_exec_args(&exec_args, template_args, 4, &block, &input, args, 2) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    b->sink += (long)strlen(exec_args.argv[2]);
+    free_exec_args(&exec_args);
+}
+
+static void bench_print_tree(void *arg) {
+    BENCH *b = arg;
+    for (MD_NODE *root = b->doc.root; root; root = root->next) {
+        Tree tree;
+        tree_init(&tree);
+        tree_root(&tree, root->text.text, root->text.size);
+        node_to_tree_with_desc(root, &tree);
+        tree_print(&tree, b->null);
+        free_tree(&tree);
+    }
+}
+
+static void sum_widths(BENCH *b, MD_NODE *node) {
+    for (; node; node = node->next) {
+        b->sink += string_width_n(node->text.text, node->text.size);
+        b->sink += string_width_n(node->description.text, node->description.size);
+        sum_widths(b, node->child);
+    }
+}
+
+static void bench_string_width(void *arg) {
+    BENCH *b = arg;
+    sum_widths(b, b->doc.root);
+}
+
+static void find_largest_code(BENCH *b, MD_NODE *node) {
+    for (; node; node = node->next) {
+        for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+            if (block->code.size > b->code.size) {
+                b->code = block->code;
+            }
+        }
+        find_largest_code(b, node->child);
+    }
+}
+
+int main(int argc, char **argv) {
+    config.program  = "bench";
+    config.no_cache = 1;
+    setenv("MD_BENCH", "sh,-c,{CODE}", 1);
+
+    static const struct {
+        const char *name;
+        void (*fn)(void *);
+    } benchmarks[] = {
+        {"parse_file/md4c", bench_parse_md4c},
+        {"parse_file/scan", bench_parse_scan},
+        {"text_callback/view", bench_text_view},
+        {"text_callback/buffer", bench_text_buffer},
+        {"find_node/text", bench_find_node},
+        {"find_node/path", bench_find_path},
+        {"get_executor", bench_get_executor},
+        {"build_exec_args", bench_build_exec_args},
+        {"print_tree", bench_print_tree},
+        {"string_width", bench_string_width},
+    };
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s DOC...\n", argv[0]);
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        BENCH b = {.path = argv[i], .null = fopen("/dev/null", "w")};
+        if (!b.null || !(b.doc.root = parse_file(b.path, &b.doc, NULL))) {
+            fprintf(stderr, "Cannot parse %s\n", b.path);
+            return 1;
+        }
+        find_largest_code(&b, b.doc.root);
+        b.lines = malloc(b.code.size + 1);
+        if (!b.lines) {
+            return 1;
+        }
+        memcpy(b.lines, b.code.text, b.code.size);
+
+        for (size_t j = 0; j < sizeof(benchmarks) / sizeof(benchmarks[0]); j++) {
+            bench(benchmarks[j].name, b.path, benchmarks[j].fn, &b);
+        }
+        free(b.lines);
+        free_doc(&b.doc);
+        fclose(b.null);
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Print a synthetic doc for the benchmarks on stdout:
+//
+//   gen_doc KIND HEADINGS
+//
+// KIND is one of
+//   flat  headings side by side, each with a description and a block
+//   deep  headings nested six levels deep, over and over
+//   code  headings with huge code blocks
+//   cjk   headings and descriptions in CJK text
+//
+// Every doc starts with a "noop" heading and ends with a "last" heading,
+// both running `true`, for the benchmarks to run and look up.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CODE_LINES 500
+
+static void print_block(int index, int lines) {
+    printf("```sh\n");
+    for (int i = 0; i < lines; i++) {
+        printf("echo \"step %d of task %d\" | tr a-z A-Z >/dev/null\n", i, index);
+    }
+    printf("```\n\n");
+}
+
+int main(int argc, char **argv) {
+    const char *kind  = argc > 1 ? argv[1] : "flat";
+    long        count = argc > 2 ? strtol(argv[2], NULL, 10) : 10000;
+    if (count < 0 || (strcmp(kind, "flat") && strcmp(kind, "deep") && strcmp(kind, "code") && strcmp(kind, "cjk"))) {
+        fprintf(stderr, "Usage: %s flat|deep|code|cjk HEADINGS\n", argv[0]);
+        return 1;
+    }
+
+    printf("# Bench\n\nA synthetic %s doc of %ld headings.\n\n## noop\n\nDo nothing.\n\n```sh\ntrue\n```\n\n", kind, count);
+    for (long i = 0; i < count; i++) {
+        if (strcmp(kind, "flat") == 0) {
+            printf("## task-%ld\n\nRun task %ld.\n\n", i, i);
+            print_block((int)i, 1);
+        } else if (strcmp(kind, "deep") == 0) {
+            // Levels 2 to 6 over and over, so each heading but those of
+            // level 2 is the child of the one before it
+            int level = 2 + (int)(i % 5);
+            printf("%.*s node-%ld\n\nNode %ld at level %d.\n\n", level, "######", i, i, level);
+            print_block((int)i, 1);
+        } else if (strcmp(kind, "code") == 0) {
+            printf("## block-%ld\n\nA block of %d lines.\n\n", i, CODE_LINES);
+            print_block((int)i, CODE_LINES);
+        } else {
+            printf("## 任务-%ld：构建发布版本\n\n使用ｚｉｇ编译Ｃ版本，这是第 %ld 个任务。\n\n", i, i);
+            print_block((int)i, 1);
+        }
+    }
+    printf("## last\n\nThe last heading.\n\n```sh\ntrue\n```\n");
+    return 0;
+}
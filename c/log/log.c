@@ -0,0 +1,93 @@
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const char *level_names[] = {"error", "warn", "info", "debug", "trace"};
+
+// The log file stays open for the whole run and is written through a large
+// buffer, flushed at exit and by log_flush() before forking.
+static struct {
+    FILE           *fp;
+    const char     *program;
+    int             level;
+    struct timespec start;
+    char            buffer[LOG_BUFFER_SIZE];
+} logger = {.fp = NULL, .program = NULL, .level = LOG_INFO};
+
+// Open path for appending. Messages above level are dropped at runtime.
+int log_open(const char *path, const char *program, int level) {
+    if (logger.fp) {
+        log_close();
+    }
+
+    logger.fp = fopen(path, "a");
+    if (!logger.fp) {
+        return -1;
+    }
+    setvbuf(logger.fp, logger.buffer, _IOFBF, sizeof(logger.buffer));
+    logger.program = program;
+    logger.level   = level;
+    clock_gettime(CLOCK_MONOTONIC, &logger.start);
+
+    static int registered = 0;
+    if (!registered) {
+        atexit(log_close);
+        registered = 1;
+    }
+    return 0;
+}
+
+// Level of a name such as "debug", or -1
+int log_parse_level(const char *name) {
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Whether messages of level would be written
+int log_enabled(int level) {
+    return logger.fp && level <= logger.level && level <= LOG_MAX_LEVEL;
+}
+
+// Write one message, prefixed with the seconds elapsed since log_open()
+void log_write(int level, const char *format, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long seconds = (long)(now.tv_sec - logger.start.tv_sec);
+    long nanos   = now.tv_nsec - logger.start.tv_nsec;
+    if (nanos < 0) {
+        seconds--;
+        nanos += 1000000000L;
+    }
+
+    // Keep the prefix and message of a thread together
+    flockfile(logger.fp);
+    fprintf(logger.fp, "[%5ld.%06ld] %s:%s: ", seconds, nanos / 1000, logger.program, level_names[level]);
+    va_list args;
+    va_start(args, format);
+    vfprintf(logger.fp, format, args);
+    va_end(args);
+    funlockfile(logger.fp);
+}
+
+void log_flush(void) {
+    if (logger.fp) {
+        fflush(logger.fp);
+    }
+}
+
+void log_close(void) {
+    if (logger.fp) {
+        fclose(logger.fp);
+        logger.fp = NULL;
+    }
+}
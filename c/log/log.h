@@ -0,0 +1,42 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+// Messages above this level are compiled out. Build with
+// -DLOG_MAX_LEVEL=LOG_TRACE to keep the trace messages.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_BUFFER_SIZE (64 * 1024)
+
+#define log_at(level, ...)                    \
+    do {                                      \
+        if ((level) <= LOG_MAX_LEVEL) {       \
+            log_write((level), __VA_ARGS__);  \
+        }                                     \
+    } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+
+// Function prototypes
+int  log_open(const char *path, const char *program, int level);
+int  log_parse_level(const char *name);
+int  log_enabled(int level);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+void log_close(void);
+
+#endif /* LOG_H */
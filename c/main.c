@@ -1,17 +1,45 @@
+// memfd_create(), pipe2()
+#define _GNU_SOURCE
+
+#include "arena/arena.c"
+#include "log/log.c"
 #include "md4c/md4c.c"
+#include "timing/timing.c"
 #include "tree/tree.c"
 #include "wcwidth/wcwidth.c"
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
 #include <libgen.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -23,33 +51,99 @@ struct config {
     int code;
     int one;
     int tree;
+    int no_cache;
+    int rebuild_cache;
+    int fast_scan;
+    int timings;
+    int keep_going;
+    int jobs;
+    int serve;
+    int watch;
+    int batch;
+    int session;
+    int output;      // OUTPUT_RAW, OUTPUT_PREFIX or OUTPUT_GROUP
+    int output_time; // Lines of prefix output start with a time
 
     // Options
-    char *file_path;
+    char  *file_path;
+    glob_t files; // Docs of each -f, with globs expanded
+    char  *batch_file;
+    char  *limits; // --limits, applying to every heading
     char *log_file;
+    int   log_level;
 } config;
 
+// Add the docs of -f path, a file or a glob of files
+static void add_file(char *path) {
+    int flags = GLOB_NOCHECK | (config.files.gl_pathc ? GLOB_APPEND : 0);
+    if (glob(path, flags, NULL, &config.files) != 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    config.file_path = config.files.gl_pathv[0];
+}
+
 static void tolower_in_place(char *str) {
     for (size_t i = 0; str[i]; i++) {
         str[i] = (char)tolower((unsigned char)str[i]);
     }
 }
 
-char *substr(char *str, int start, int length) {
-    if (!str || start < 0 || length < 0 || start + length > strlen(str)) {
-        return NULL;
+// Non-owning (pointer, length) view, not NUL-terminated. A view with a NULL
+// text is absent, which is different from an empty one.
+typedef struct {
+    const char *text;
+    size_t      size;
+} STR_VIEW;
+
+static STR_VIEW str_view(const char *str) {
+    STR_VIEW view = {str, str ? strlen(str) : 0};
+    return view;
+}
+
+static int str_view_casecmp(STR_VIEW view, const char *str) {
+    size_t len = strlen(str);
+    if (view.size != len) {
+        return 1;
+    }
+    return len ? strncasecmp(view.text, str, len) : 0;
+}
+
+static void str_view_print_lower(STR_VIEW view, FILE *stream) {
+    for (size_t i = 0; i < view.size; i++) {
+        putc(tolower((unsigned char)view.text[i]), stream);
+    }
+}
+
+// Next word of *list, separated by whitespace or commas, or a NULL view at
+// the end
+static STR_VIEW next_word(STR_VIEW *list) {
+    size_t i = 0;
+    while (i < list->size && (isspace((unsigned char)list->text[i]) || list->text[i] == ',')) {
+        i++;
+    }
+    size_t start = i;
+    while (i < list->size && !isspace((unsigned char)list->text[i]) && list->text[i] != ',') {
+        i++;
     }
-    char *sub = (char *)malloc(length + 1);
-    memcpy(sub, str + start, length);
-    sub[length] = '\0';
-    return sub;
+    STR_VIEW word = {start < i ? list->text + start : NULL, i - start};
+    list->text += i;
+    list->size -= i;
+    return word;
 }
 
-// Language configuration structure
+// Language configuration structure. Executors with build arguments compile
+// the code to {OUT} first, and then run prefix_args, where {OUT} is the
+// cached binary. Executors with session arguments can run blocks one after
+// another in one interpreter, see run_session().
 struct Executor {
     const char  *lang;
     const char **prefix_args;
     size_t       prefix_args_count;
+    const char **build_args;
+    size_t       build_args_count;
+    const char **session_args;
+    size_t       session_args_count;
 };
 
 static const char *sh_args[]         = {"{LANG}", "-euc", "{CODE}", "--"};
@@ -60,174 +154,394 @@ static const char *ruby_args[]       = {"ruby", "-e", "{CODE}"};
 static const char *php_args[]        = {"php", "-r", "{CODE}"};
 static const char *cmd_args[]        = {"cmd.exe", "/c", "{CODE}"};
 static const char *powershell_args[] = {"powershell.exe", "-c", "{CODE}"};
+static const char *out_args[]        = {"{OUT}"};
+static const char *c_build_args[]    = {"cc", "-x", "c", "{CODE_FILE}", "-o", "{OUT}"};
+static const char *cpp_build_args[]  = {"c++", "-x", "c++", "{CODE_FILE}", "-o", "{OUT}"};
+static const char *rust_build_args[] = {"rustc", "--crate-name", "main", "-o", "{OUT}", "{CODE_FILE}"};
+
+// Session drivers. Each reads "<bytes> <lines>\n" and the code of a block
+// from SESSION_CODE_FD, runs it where the blocks before it ran, and writes
+// "0\n" to SESSION_STATUS_FD once it is done. A block that fails ends the
+// interpreter with its exit code. The code of the blocks does not inherit
+// the two fds.
+#define SESSION_CODE_FD   8
+#define SESSION_STATUS_FD 9
+
+static const char *sh_session_args[] = {
+    "{LANG}", "-euc",
+    "while read -r cr_size cr_lines <&8; do\n"
+    "  cr_code=\n"
+    "  while [ \"$cr_lines\" -gt 0 ] && IFS= read -r cr_line <&8; do\n"
+    "    cr_code=\"$cr_code$cr_line\n\"\n"
+    "    cr_lines=$((cr_lines - 1))\n"
+    "  done\n"
+    "  eval \"$cr_code\" 8<&- 9>&-\n"
+    "  echo 0 >&9\n"
+    "done\n",
+    "--"};
+static const char *python_session_args[] = {
+    "python", "-c",
+    "import os, sys\n"
+    "os.set_inheritable(8, False)\n"
+    "os.set_inheritable(9, False)\n"
+    "cr_code, cr_status, cr_globals = os.fdopen(8, 'rb'), os.fdopen(9, 'w'), {'__name__': '__main__'}\n"
+    "for cr_header in cr_code:\n"
+    "    exec(compile(cr_code.read(int(cr_header.split()[0])), '<block>', 'exec'), cr_globals)\n"
+    "    sys.stdout.flush()\n"
+    "    sys.stderr.flush()\n"
+    "    cr_status.write('0\\n')\n"
+    "    cr_status.flush()\n"};
+// Callbacks a block leaves behind run after the last block
+static const char *node_session_args[] = {
+    "node", "-e",
+    "const fs = require('fs'), vm = require('vm');\n"
+    "let buf = Buffer.alloc(0);\n"
+    "const fill = () => {\n"
+    "  const chunk = Buffer.alloc(65536), n = fs.readSync(8, chunk, 0, chunk.length, null);\n"
+    "  buf = Buffer.concat([buf, chunk.subarray(0, n)]);\n"
+    "  return n;\n"
+    "};\n"
+    "for (;;) {\n"
+    "  let end;\n"
+    "  while ((end = buf.indexOf(10)) < 0 && fill() > 0) {}\n"
+    "  if (end < 0) break;\n"
+    "  const size = parseInt(buf.subarray(0, end).toString(), 10);\n"
+    "  buf = buf.subarray(end + 1);\n"
+    "  while (buf.length < size && fill() > 0) {}\n"
+    "  vm.runInThisContext(buf.subarray(0, size).toString(), {filename: 'block'});\n"
+    "  buf = buf.subarray(size);\n"
+    "  fs.writeSync(9, '0\\n');\n"
+    "}\n"};
+static const char *ruby_session_args[] = {
+    "ruby", "-e",
+    "cr_code, cr_status = IO.new(8, 'rb'), IO.new(9, 'w')\n"
+    "cr_code.close_on_exec = cr_status.close_on_exec = true\n"
+    "while (cr_header = cr_code.gets)\n"
+    "  eval(cr_code.read(cr_header.to_i), TOPLEVEL_BINDING, 'block')\n"
+    "  $stdout.flush\n"
+    "  $stderr.flush\n"
+    "  cr_status.write(\"0\\n\")\n"
+    "  cr_status.flush\n"
+    "end\n"};
+
+enum {
+    EXEC_SH,
+    EXEC_BASH,
+    EXEC_ZSH,
+    EXEC_FISH,
+    EXEC_DASH,
+    EXEC_KSH,
+    EXEC_ASH,
+    EXEC_AWK,
+    EXEC_JS,
+    EXEC_JAVASCRIPT,
+    EXEC_PY,
+    EXEC_PYTHON,
+    EXEC_RB,
+    EXEC_RUBY,
+    EXEC_PHP,
+    EXEC_CMD,
+    EXEC_BATCH,
+    EXEC_POWERSHELL,
+    EXEC_C,
+    EXEC_CPP,
+    EXEC_CXX,
+    EXEC_CPLUSPLUS,
+    EXEC_RS,
+    EXEC_RUST,
+};
 
 static const struct Executor executors[] = {
-    {"sh", sh_args, 4},
-    {"bash", sh_args, 4},
-    {"zsh", sh_args, 4},
-    {"fish", sh_args, 4},
-    {"dash", sh_args, 4},
-    {"ksh", sh_args, 4},
-    {"ash", sh_args, 4},
+    [EXEC_SH]   = {"sh", sh_args, 4, NULL, 0, sh_session_args, 4},
+    [EXEC_BASH] = {"bash", sh_args, 4, NULL, 0, sh_session_args, 4},
+    [EXEC_ZSH]  = {"zsh", sh_args, 4, NULL, 0, sh_session_args, 4},
+    [EXEC_FISH] = {"fish", sh_args, 4},
+    [EXEC_DASH] = {"dash", sh_args, 4, NULL, 0, sh_session_args, 4},
+    [EXEC_KSH]  = {"ksh", sh_args, 4, NULL, 0, sh_session_args, 4},
+    [EXEC_ASH]  = {"ash", sh_args, 4, NULL, 0, sh_session_args, 4},
     // {"shell", sh_args, 4},
-    {"awk", awk_args, 2},
-    {"js", node_args, 3},
-    {"javascript", node_args, 3},
-    {"py", python_args, 3},
-    {"python", python_args, 3},
-    {"rb", ruby_args, 3},
-    {"ruby", ruby_args, 3},
-    {"php", php_args, 3},
-    {"cmd", cmd_args, 3},
-    {"batch", cmd_args, 3},
-    {"powershell", powershell_args, 3}};
+    [EXEC_AWK]        = {"awk", awk_args, 2},
+    [EXEC_JS]         = {"js", node_args, 3, NULL, 0, node_session_args, 3},
+    [EXEC_JAVASCRIPT] = {"javascript", node_args, 3, NULL, 0, node_session_args, 3},
+    [EXEC_PY]         = {"py", python_args, 3, NULL, 0, python_session_args, 3},
+    [EXEC_PYTHON]     = {"python", python_args, 3, NULL, 0, python_session_args, 3},
+    [EXEC_RB]         = {"rb", ruby_args, 3, NULL, 0, ruby_session_args, 3},
+    [EXEC_RUBY]       = {"ruby", ruby_args, 3, NULL, 0, ruby_session_args, 3},
+    [EXEC_PHP]        = {"php", php_args, 3},
+    [EXEC_CMD]        = {"cmd", cmd_args, 3},
+    [EXEC_BATCH]      = {"batch", cmd_args, 3},
+    [EXEC_POWERSHELL] = {"powershell", powershell_args, 3},
+    [EXEC_C]          = {"c", out_args, 1, c_build_args, 6},
+    [EXEC_CPP]        = {"cpp", out_args, 1, cpp_build_args, 6},
+    [EXEC_CXX]        = {"cxx", out_args, 1, cpp_build_args, 6},
+    [EXEC_CPLUSPLUS]  = {"c++", out_args, 1, cpp_build_args, 6},
+    [EXEC_RS]         = {"rs", out_args, 1, rust_build_args, 6},
+    [EXEC_RUST]       = {"rust", out_args, 1, rust_build_args, 6}};
+
+// Built-in executor of lang. The length and the first letter select a few
+// candidates, so a lookup is a switch and a comparison or two.
+static const struct Executor *get_builtin_executor(STR_VIEW lang) {
+#define EXEC_KEY(size, first) ((size) << 8 | (first))
+#define EXEC_TRY(id)                                          \
+    if (str_view_casecmp(lang, executors[id].lang) == 0) {    \
+        return &executors[id];                                \
+    }
+
+    if (lang.size == 0 || lang.size > 10) {
+        return NULL;
+    }
+    switch (EXEC_KEY(lang.size, tolower((unsigned char)lang.text[0]))) {
+        case EXEC_KEY(1, 'c'): EXEC_TRY(EXEC_C); break;
+        case EXEC_KEY(2, 's'): EXEC_TRY(EXEC_SH); break;
+        case EXEC_KEY(2, 'j'): EXEC_TRY(EXEC_JS); break;
+        case EXEC_KEY(2, 'p'): EXEC_TRY(EXEC_PY); break;
+        case EXEC_KEY(2, 'r'):
+            EXEC_TRY(EXEC_RB);
+            EXEC_TRY(EXEC_RS);
+            break;
+        case EXEC_KEY(3, 'z'): EXEC_TRY(EXEC_ZSH); break;
+        case EXEC_KEY(3, 'k'): EXEC_TRY(EXEC_KSH); break;
+        case EXEC_KEY(3, 'a'):
+            EXEC_TRY(EXEC_ASH);
+            EXEC_TRY(EXEC_AWK);
+            break;
+        case EXEC_KEY(3, 'p'): EXEC_TRY(EXEC_PHP); break;
+        case EXEC_KEY(3, 'c'):
+            EXEC_TRY(EXEC_CMD);
+            EXEC_TRY(EXEC_CPP);
+            EXEC_TRY(EXEC_CXX);
+            EXEC_TRY(EXEC_CPLUSPLUS);
+            break;
+        case EXEC_KEY(4, 'b'): EXEC_TRY(EXEC_BASH); break;
+        case EXEC_KEY(4, 'f'): EXEC_TRY(EXEC_FISH); break;
+        case EXEC_KEY(4, 'd'): EXEC_TRY(EXEC_DASH); break;
+        case EXEC_KEY(4, 'r'):
+            EXEC_TRY(EXEC_RUBY);
+            EXEC_TRY(EXEC_RUST);
+            break;
+        case EXEC_KEY(5, 'b'): EXEC_TRY(EXEC_BATCH); break;
+        case EXEC_KEY(6, 'p'): EXEC_TRY(EXEC_PYTHON); break;
+        case EXEC_KEY(10, 'j'): EXEC_TRY(EXEC_JAVASCRIPT); break;
+        case EXEC_KEY(10, 'p'): EXEC_TRY(EXEC_POWERSHELL); break;
+    }
+    return NULL;
+
+#undef EXEC_KEY
+#undef EXEC_TRY
+}
 
+// Languages looked up in the environment so far, including the ones without
+// an MD_<LANG> variable.
 typedef struct custom_executor {
+    char                   *lang;
     struct Executor        *executor;
+    const char            **args;   // Of executor, pointing into values
+    char                   *values; // Copy of the MD_<LANG> value
     struct custom_executor *next;
 } CustomExecutor;
 
 static CustomExecutor *custom_executors = NULL;
 
-static void parse_custom_executors(void) {
-    extern char **environ;
-    for (char **env = environ; *env; env++) {
-        char *env_entry = *env;
-        if (strncmp(env_entry, "MD_", 3) != 0) {
-            continue;
-        }
-
-        char *separator = strchr(env_entry, '=');
-        if (!separator) {
-            continue;
-        }
+// Parse an MD_<LANG> value such as "python3,-c,{CODE}" into the executor
+// of entry.
+static struct Executor *parse_custom_executor(CustomExecutor *entry, const char *value) {
+    const char *lang       = entry->lang;
+    char       *value_copy = strdup(value);
+    if (!value_copy) {
+        return NULL;
+    }
 
-        *separator  = '\0';
-        char *key   = env_entry + 3;
-        char *value = separator + 1;
-        if (!*key || !*value) {
-            continue;
-        }
+    size_t arg_count = 0;
+    for (char *token = strtok(value_copy, ","); token; token = strtok(NULL, ",")) {
+        arg_count++;
+    }
+    if (arg_count == 0) {
+        free(value_copy);
+        return NULL;
+    }
 
-        char *lang = strdup(key);
-        if (!lang) {
-            continue;
-        }
-        tolower_in_place(lang);
-        // printf("lang=%s, val=%s\n", lang, value);
+    struct Executor *executor = malloc(sizeof(*executor));
+    const char     **args     = calloc(arg_count, sizeof(char *));
+    if (!executor || !args) {
+        free(executor);
+        free(args);
+        free(value_copy);
+        return NULL;
+    }
 
-        char *value_copy = strdup(value);
-        if (!value_copy) {
-            return;
-        }
+    // The tokens point into value_copy, which is kept with the executor
+    strcpy(value_copy, value);
+    size_t idx = 0;
+    for (char *token = strtok(value_copy, ","); token; token = strtok(NULL, ",")) {
+        args[idx++] = token;
+    }
 
-        size_t arg_count = 0;
-        for (char *token = strtok(value_copy, ","); token; token = strtok(NULL, ",")) {
-            arg_count++;
+    executor->lang               = lang;
+    executor->prefix_args        = args;
+    executor->prefix_args_count  = arg_count;
+    executor->build_args         = NULL;
+    executor->build_args_count   = 0;
+    executor->session_args       = NULL;
+    executor->session_args_count = 0;
+
+    // "build,...,{RUN},run,..." compiles with the arguments before {RUN}
+    for (size_t i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "{RUN}") == 0) {
+            if (i > 0) {
+                executor->build_args       = args;
+                executor->build_args_count = i;
+            }
+            executor->prefix_args       = args + i + 1;
+            executor->prefix_args_count = arg_count - i - 1;
+            if (executor->prefix_args_count == 0) {
+                executor->prefix_args       = out_args;
+                executor->prefix_args_count = 1;
+            }
+            break;
         }
+    }
+    entry->args   = args;
+    entry->values = value_copy;
+    return executor;
+}
 
-        if (arg_count == 0) {
-            free(value_copy);
-            return;
-        }
+// Find the MD_<LANG> variable of lang, matching LANG case-insensitively. The
+// environment is only scanned, and the value only parsed, the first time a
+// language is asked for.
+static const struct Executor *get_custom_executor(STR_VIEW lang) {
+    extern char **environ;
 
-        const char **args = calloc(arg_count, sizeof(char *));
-        if (!args) {
-            free(value_copy);
-            return;
+    for (CustomExecutor *e = custom_executors; e; e = e->next) {
+        if (str_view_casecmp(lang, e->lang) == 0) {
+            return e->executor;
         }
+    }
 
-        free(value_copy);
-        value_copy = strdup(value);
-        size_t idx = 0;
-        for (char *token = strtok(value_copy, ","); token; token = strtok(NULL, ",")) {
-            args[idx++] = strdup(token);
-        }
+    CustomExecutor *entry = malloc(sizeof(*entry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->lang = strndup(lang.text, lang.size);
+    if (!entry->lang) {
+        free(entry);
+        return NULL;
+    }
+    tolower_in_place(entry->lang);
+    entry->executor = NULL;
+    entry->args     = NULL;
+    entry->values   = NULL;
 
-        struct Executor *executor = malloc(sizeof(*executor));
-        if (!executor) {
-            free(value_copy);
-            for (size_t i = 0; i < idx; i++) {
-                free((char *)args[i]);
-            }
-            free(args);
-            return;
+    for (char **env = environ; *env; env++) {
+        const char *env_entry = *env;
+        if (strncmp(env_entry, "MD_", 3) != 0 || lang.size == 0 ||
+            strncasecmp(env_entry + 3, lang.text, lang.size) != 0 || env_entry[3 + lang.size] != '=') {
+            continue;
         }
 
-        executor->lang              = strdup(lang);
-        executor->prefix_args       = args;
-        executor->prefix_args_count = arg_count;
-
-        CustomExecutor *new_custom_executor = malloc(sizeof(*env_entry));
-        if (!new_custom_executor) {
-            free((void *)executor->lang);
-            for (size_t i = 0; i < idx; i++) {
-                free((char *)args[i]);
-            }
-            free(args);
-            free(executor);
-            free(value_copy);
-            return;
+        // The first of the variables differing only in case wins
+        const char *value = env_entry + 3 + lang.size + 1;
+        if (*value) {
+            entry->executor = parse_custom_executor(entry, value);
         }
+        break;
+    }
 
-        new_custom_executor->executor = executor;
-        new_custom_executor->next     = custom_executors;
-        custom_executors              = new_custom_executor;
+    entry->next      = custom_executors;
+    custom_executors = entry;
+    return entry->executor;
+}
 
-        free(value_copy);
-        free(lang);
+// Forget the languages looked up so far, for when the environment changes
+static void free_custom_executors(void) {
+    while (custom_executors) {
+        CustomExecutor *entry = custom_executors;
+        custom_executors      = entry->next;
+        free(entry->executor);
+        free(entry->args);
+        free(entry->values);
+        free(entry->lang);
+        free(entry);
     }
 }
 
-const struct Executor *get_executor(const char *lang) {
-    for (CustomExecutor *e = custom_executors; e; e = e->next) {
-        if (strcasecmp(e->executor->lang, lang) == 0) {
-            return e->executor;
-        }
+const struct Executor *get_executor(STR_VIEW lang) {
+    if (!lang.text) {
+        return NULL;
     }
 
-    for (size_t i = 0; i < sizeof(executors) / sizeof(executors[0]); i++) {
-        if (strcasecmp(executors[i].lang, lang) == 0) {
-            return &executors[i];
-        }
+    const struct Executor *executor = get_custom_executor(lang);
+    if (executor) {
+        return executor;
     }
-
-    return NULL;
+    return get_builtin_executor(lang);
 }
 
 // Code block structure
 typedef struct CODE_BLOCK CODE_BLOCK;
 struct CODE_BLOCK {
-    char       *info;
-    char       *code;
+    STR_VIEW    info;
+    STR_VIEW    code;
     CODE_BLOCK *next;
+
+    // Resolved from info on first use
+    const struct Executor *executor;
+    int                    executor_resolved;
 };
 
 // Markdown AST node structure
 typedef struct MD_NODE MD_NODE;
 struct MD_NODE {
     int         level;
-    char       *text;
-    char       *description;
+    STR_VIEW    text;
+    STR_VIEW    description;
+    STR_VIEW    deps;    // Headings to run first
+    STR_VIEW    inputs;  // Files the code reads
+    STR_VIEW    outputs; // Files the code writes
+    STR_VIEW    limits;  // Resource limits of the code
     CODE_BLOCK *code_block;
     MD_NODE    *next;
     MD_NODE    *parent;
     MD_NODE    *child;
+
+    unsigned int order;     // Position in document order
+    MD_NODE     *next_same; // Next node with the same heading text
 };
 
-CODE_BLOCK *new_code_block(char *info) {
-    CODE_BLOCK *block = malloc(sizeof(CODE_BLOCK));
+CODE_BLOCK *new_code_block(Arena *arena, STR_VIEW info) {
+    CODE_BLOCK *block = arena_alloc(arena, sizeof(CODE_BLOCK));
+    if (!block) {
+        return NULL;
+    }
     block->info       = info;
-    block->code       = NULL;
+    block->code       = (STR_VIEW){NULL, 0};
     block->next       = NULL;
+
+    block->executor          = NULL;
+    block->executor_resolved = 0;
     return block;
 }
 
-MD_NODE *new_md_node() {
-    MD_NODE *node     = malloc(sizeof(MD_NODE));
+// Executor of a code block, resolved once per block.
+const struct Executor *block_executor(CODE_BLOCK *block) {
+    if (!block->executor_resolved) {
+        block->executor          = get_executor(block->info);
+        block->executor_resolved = 1;
+    }
+    return block->executor;
+}
+
+MD_NODE *new_md_node(Arena *arena) {
+    MD_NODE *node = arena_alloc(arena, sizeof(MD_NODE));
+    if (!node) {
+        return NULL;
+    }
     node->level       = 0;
-    node->text        = NULL;
-    node->description = NULL;
+    node->text        = (STR_VIEW){NULL, 0};
+    node->description = (STR_VIEW){NULL, 0};
+    node->deps        = (STR_VIEW){NULL, 0};
+    node->inputs      = (STR_VIEW){NULL, 0};
+    node->outputs     = (STR_VIEW){NULL, 0};
+    node->limits      = (STR_VIEW){NULL, 0};
 
     node->code_block = NULL;
 
@@ -235,127 +549,491 @@ MD_NODE *new_md_node() {
     node->child  = NULL;
     node->parent = NULL;
 
+    node->order     = 0;
+    node->next_same = NULL;
+
     return node;
 }
 
+// Heading index
+//
+// Open addressing hash table from the case-folded heading text to the first
+// node with that text. Later nodes with the same text are chained through
+// MD_NODE.next_same in document order. Only nodes linked into the tree are
+// indexed, the same ones a walk from the root would reach.
+typedef struct {
+    MD_NODE **slots;
+    size_t    capacity; // Power of two
+    size_t    count;
+} HEADING_INDEX;
+
+// Parsed document
+typedef struct {
+    MD_NODE      *root;
+    Arena         arena; // Owns the nodes and code blocks
+    HEADING_INDEX index;
+    void         *map; // Doc or cache mapping the node texts point into
+    size_t        map_size;
+    int           from_snapshot; // Mapped from CR_DOC_FD
+    int           partial;       // Parsed only up to the end of a target section
+} MD_DOC;
+
+// Parsed tree of the doc
+static MD_DOC doc;
+
+static uint64_t heading_hash(STR_VIEW text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < text.size; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)text.text[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int heading_equal(STR_VIEW a, STR_VIEW b) {
+    return a.size == b.size && (a.size == 0 || strncasecmp(a.text, b.text, a.size) == 0);
+}
+
+static MD_NODE **index_slot(MD_NODE **slots, size_t capacity, STR_VIEW text) {
+    size_t mask = capacity - 1;
+    for (size_t i = (size_t)heading_hash(text) & mask;; i = (i + 1) & mask) {
+        if (!slots[i] || heading_equal(slots[i]->text, text)) {
+            return &slots[i];
+        }
+    }
+}
+
+// Add node after every node added before it with the same text.
+int index_add(HEADING_INDEX *index, MD_NODE *node) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        size_t    capacity = index->capacity ? index->capacity * 2 : 64;
+        MD_NODE **slots    = calloc(capacity, sizeof(MD_NODE *));
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i]) {
+                *index_slot(slots, capacity, index->slots[i]->text) = index->slots[i];
+            }
+        }
+        free(index->slots);
+        index->slots    = slots;
+        index->capacity = capacity;
+    }
+
+    MD_NODE **slot = index_slot(index->slots, index->capacity, node->text);
+    if (!*slot) {
+        *slot = node;
+        index->count++;
+        return 0;
+    }
+    MD_NODE *last = *slot;
+    while (last->next_same) {
+        last = last->next_same;
+    }
+    last->next_same = node;
+    return 0;
+}
+
+// First node in document order with the heading text, ignoring case.
+MD_NODE *index_get(const HEADING_INDEX *index, STR_VIEW text) {
+    if (!index->capacity) {
+        return NULL;
+    }
+    return *index_slot(index->slots, index->capacity, text);
+}
+
+void free_doc(MD_DOC *doc) {
+    arena_free(&doc->arena);
+    free(doc->index.slots);
+    if (doc->map) {
+        munmap(doc->map, doc->map_size);
+    }
+    doc->root     = NULL;
+    doc->index    = (HEADING_INDEX){0};
+    doc->map           = NULL;
+    doc->map_size      = 0;
+    doc->from_snapshot = 0;
+    doc->partial       = 0;
+}
+
+// Whether the '/'-separated segments of path name node and its closest
+// ancestors, as in "build/build:c". A leading '/' anchors the path at a
+// top-level heading.
+static int node_matches_path(const MD_NODE *node, const char *path) {
+    const char *end = path + strlen(path);
+    while (end > path && end[-1] == '/') {
+        end--;
+    }
+    if (end == path) {
+        return 0;
+    }
+
+    while (end > path) {
+        const char *begin = end;
+        while (begin > path && begin[-1] != '/') {
+            begin--;
+        }
+        STR_VIEW segment = {begin, (size_t)(end - begin)};
+        if (!node || !node->text.text || !heading_equal(node->text, segment)) {
+            return 0;
+        }
+        node = node->parent;
+        end  = begin;
+        while (end > path && end[-1] == '/') {
+            end--;
+        }
+    }
+    return path[0] != '/' || node == NULL;
+}
+
+// Whether node is the one heading names, by its text or by a path.
+static int node_matches(const MD_NODE *node, const char *heading) {
+    if (node->text.text && str_view_casecmp(node->text, heading) == 0) {
+        return 1;
+    }
+    return strchr(heading, '/') && node_matches_path(node, heading);
+}
+
 // Callback structure to store state
 typedef struct {
     int          depth;
     MD_BLOCKTYPE block_type;
     MD_SPANTYPE  span_type;
-    char        *content;
+
+    // Text of the current block. It is a view into the document while md4c
+    // hands back contiguous text, and only falls back to the buffer when the
+    // text is split across chunks. The buffer grows geometrically and is
+    // reused by every block of the parse.
+    STR_VIEW content;
+    int      buffered;
+    char    *buffer;
+    size_t   buffer_capacity;
+
+    const char *doc;
+    size_t      doc_size;
+
+    // Nodes, code blocks and copied text all live in the arena, headings
+    // are added to the index as they get linked into the tree
+    Arena         *arena;
+    HEADING_INDEX *index;
+    unsigned int   node_count;
+
+    // Targeted parse: only the section of the first heading matching target
+    // is built, and parsing stops once that section is closed.
+    const char *target;
+    MD_NODE    *target_node;
 
     MD_NODE *root;
     MD_NODE *last;
 } CallbackData;
 
+// Returned by the callbacks to stop md4c after the target section. md4c
+// only propagates negative values, and uses -1 for its own errors.
+#define PARSE_STOPPED (-2)
+
+// Whether the current block lies before the target section, where only the
+// headings are kept to link the tree.
+static int skip_section(CallbackData *data) {
+    return data->target && !data->target_node;
+}
+
 void print_indention(int count) {
     for (int i = 0; i < count; i++) {
         printf("    ");
     }
 }
 
-void log_printf(const char *format, ...) {
-    if (!config.log_file) {
-        return;
-    }
-
-    FILE *log_fp = fopen(config.log_file, "a");
-    if (!log_fp) {
-        return;
-    }
-
-    va_list args;
-    va_start(args, format);
-    fprintf(log_fp, "%s:info: ", config.program);
-    vfprintf(log_fp, format, args);
-    va_end(args);
-    fclose(log_fp);
-}
-
 void error(const char *format, ...) {
     va_list args;
     va_start(args, format);
+    if (log_enabled(LOG_ERROR)) {
+        va_list log_args;
+        va_copy(log_args, args);
+        char message[1024];
+        vsnprintf(message, sizeof(message), format, log_args);
+        va_end(log_args);
+        log_error("%s", message);
+    }
     fprintf(stderr, "%s:error: ", config.program);
     vfprintf(stderr, format, args);
     va_end(args);
 }
 
+// Find the doc in the working directory or the closest of its parents,
+// stopping at $CR_ROOT if it is one of them. Each directory is looked up
+// relative to an fd of it, so a lookup does not resolve the whole path
+// again.
 char *find_doc(char *program_basename) {
-    char        file_pattern[3][PATH_MAX];
-    char        current_dir[PATH_MAX];
-    char        parent_dir[PATH_MAX];
-    char        full_path[PATH_MAX];
-    struct stat st;
-
-    snprintf(file_pattern[0], sizeof(file_pattern[0]), "scripts.md");
-    snprintf(file_pattern[1], sizeof(file_pattern[1]), ".scripts.md");
-    snprintf(file_pattern[2], sizeof(file_pattern[2]), "README.md");
+    static const char *file_pattern[] = {"scripts.md", ".scripts.md", "README.md"};
+    char               current_dir[PATH_MAX];
+    char               root_dir[PATH_MAX];
+    char              *found    = NULL;
+    long               syscalls = 1;
+    struct stat        st;
 
     if (getcwd(current_dir, sizeof(current_dir)) == NULL) {
         return NULL;
     }
+    const char *cr_root = getenv("CR_ROOT");
+    if (!cr_root || !*cr_root || !realpath(cr_root, root_dir)) {
+        root_dir[0] = '\0';
+    }
 
-    while (1) {
-        char *dir_copy = strdup(current_dir);
-        if (dir_copy == NULL) {
-            return NULL;
+    int dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    syscalls++;
+    // current_dir is cut back to the directory of dir_fd as the walk goes up
+    size_t dir_size = strlen(current_dir);
+    while (dir_fd >= 0) {
+        for (size_t i = 0; i < sizeof(file_pattern) / sizeof(file_pattern[0]); i++) {
+            log_trace("Looking for '%s' in dir '%.*s'\n", file_pattern[i], (int)dir_size, current_dir);
+            syscalls++;
+            if (fstatat(dir_fd, file_pattern[i], &st, 0) == 0 && S_ISREG(st.st_mode)) {
+                size_t size = dir_size + 1 + strlen(file_pattern[i]) + 1;
+                found       = malloc(size);
+                if (found) {
+                    snprintf(found, size, "%.*s/%s", dir_size > 1 ? (int)dir_size : 0, current_dir, file_pattern[i]);
+                }
+                break;
+            }
+        }
+
+        int at_root = dir_size <= 1 || (root_dir[0] && strlen(root_dir) == dir_size &&
+                                        strncmp(root_dir, current_dir, dir_size) == 0);
+        if (found || at_root) {
+            break;
+        }
+        int parent_fd = openat(dir_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(dir_fd);
+        syscalls += 2;
+        dir_fd = parent_fd;
+        while (dir_size > 1 && current_dir[dir_size - 1] != '/') {
+            dir_size--;
+        }
+        if (dir_size > 1) {
+            dir_size--; // Drop the '/', except the one of the root
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+        syscalls++;
+    }
+
+    timing_count("find_doc syscalls", syscalls);
+    return found;
+}
+
+// Drop the text of the current block, keeping the buffer for the next one.
+static void reset_content(CallbackData *data) {
+    data->buffered = 0;
+    data->content  = (STR_VIEW){NULL, 0};
+}
+
+// Make room for size bytes in the buffer.
+static int reserve_buffer(CallbackData *data, size_t size) {
+    if (size <= data->buffer_capacity) {
+        return 0;
+    }
+    size_t capacity = data->buffer_capacity ? data->buffer_capacity : 256;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    char *temp = (char *)realloc(data->buffer, capacity);
+    if (temp == NULL) {
+        return -1;
+    }
+    data->buffer          = temp;
+    data->buffer_capacity = capacity;
+    if (data->buffered) {
+        data->content.text = temp;
+    }
+    return 0;
+}
+
+// Hand the text of the current block over to the tree. A view into the
+// document is passed as is, buffered text is copied out since the buffer is
+// reused.
+static STR_VIEW take_content(CallbackData *data) {
+    STR_VIEW content = data->content;
+    if (data->buffered) {
+        char *copy = arena_memdup(data->arena, content.text, content.size);
+        if (!copy) {
+            content = (STR_VIEW){NULL, 0};
+        } else {
+            content.text = copy;
+        }
+    }
+    reset_content(data);
+    return content;
+}
+
+// View of text md4c hands back outside of the text callback. It only stays a
+// view when the text lies in the document, md4c may build it in a temporary.
+static STR_VIEW doc_view(CallbackData *data, const char *text, size_t size) {
+    if (!text) {
+        return (STR_VIEW){NULL, 0};
+    }
+    if (text >= data->doc && text + size <= data->doc + data->doc_size) {
+        return (STR_VIEW){text, size};
+    }
+    char *copy = arena_memdup(data->arena, text, size);
+    if (!copy) {
+        return (STR_VIEW){NULL, 0};
+    }
+    return (STR_VIEW){copy, size};
+}
+
+static STR_VIEW trim_view(STR_VIEW view) {
+    while (view.size && isspace((unsigned char)view.text[0])) {
+        view.text++;
+        view.size--;
+    }
+    while (view.size && isspace((unsigned char)view.text[view.size - 1])) {
+        view.size--;
+    }
+    return view;
+}
+
+// Set the description of node from a paragraph. Lines of the paragraph
+// starting with "deps:", "inputs:", "outputs:" or "limits:" are directives
+// instead, and the description is the text before the first of them.
+static void set_description(MD_NODE *node, STR_VIEW content) {
+    static const char *directives[] = {"deps:", "inputs:", "outputs:", "limits:"};
+    STR_VIEW          *fields[]     = {&node->deps, &node->inputs, &node->outputs, &node->limits};
+
+    const char *end         = content.text + content.size;
+    const char *description = NULL;
+    for (const char *line = content.text; line && line < end;) {
+        const char *line_end = memchr(line, '\n', (size_t)(end - line));
+        STR_VIEW    text     = trim_view((STR_VIEW){line, (size_t)((line_end ? line_end : end) - line)});
+        for (int i = 0; i < 4; i++) {
+            size_t len = strlen(directives[i]);
+            if (text.size >= len && memcmp(text.text, directives[i], len) == 0) {
+                *fields[i] = trim_view((STR_VIEW){text.text + len, text.size - len});
+                if (!description) {
+                    description = line;
+                }
+                break;
+            }
         }
-        strncpy(parent_dir, dirname(dir_copy), sizeof(parent_dir) - 1);
-        parent_dir[sizeof(parent_dir) - 1] = '\0';
-        free(dir_copy);
+        line = line_end ? line_end + 1 : NULL;
+    }
+
+    if (!description) {
+        node->description = content;
+    } else if (description > content.text) {
+        node->description = trim_view((STR_VIEW){content.text, (size_t)(description - content.text)});
+    }
+}
 
-        int is_at_root = !strcmp(current_dir, parent_dir);
+// Add a heading of level with text after the last one, linking it under
+// the closest heading of a lower level
+static int add_heading(CallbackData *data, int level, STR_VIEW text) {
+    MD_NODE *new_node = new_md_node(data->arena);
+    if (!new_node) {
+        return -1;
+    }
+    new_node->level = level;
+    new_node->text  = text;
 
-        for (int i = 0; i < sizeof(file_pattern) / sizeof(file_pattern[0]); i++) {
-            char *file = file_pattern[i];
-            snprintf(full_path, sizeof(full_path), "%s/%s", current_dir, file);
-            log_printf("Looking for '%s' in dir '%s'\n", file, current_dir);
-            if (stat(full_path, &st) == 0) {
-                if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-                    return strdup(full_path);
+    int linked = 1;
+    if (data->root == NULL) {
+        data->root = new_node;
+    } else {
+        if (level == data->last->level) {
+            data->last->next = new_node;
+            new_node->parent = data->last->parent;
+        } else if (level > data->last->level) {
+            data->last->child = new_node;
+            new_node->parent  = data->last;
+        } else if (level < data->last->level) {
+            MD_NODE *parent = data->last->parent;
+            linked          = 0;
+            while (parent) {
+                if (parent->level == level) {
+                    parent->next     = new_node;
+                    new_node->parent = parent->parent;
+                    linked           = 1;
+                    break;
                 }
+                parent = parent->parent;
             }
         }
+    }
+    data->last = new_node;
 
-        strncpy(current_dir, parent_dir, sizeof(current_dir) - 1);
-        current_dir[sizeof(current_dir) - 1] = '\0';
-        if (is_at_root) {
-            break;
+    if (linked) {
+        new_node->order = data->node_count++;
+        if (index_add(data->index, new_node) != 0) {
+            return -1;
         }
     }
 
-    return NULL;
+    if (skip_section(data) && linked && node_matches(new_node, data->target)) {
+        log_info("Found target section: %s\n", data->target);
+        data->target_node = new_node;
+    }
+    return 0;
+}
+
+// Add a code block to the last heading
+static int add_code_block(CallbackData *data, STR_VIEW info, STR_VIEW code) {
+    CODE_BLOCK *new_code = new_code_block(data->arena, info);
+    if (!new_code) {
+        return -1;
+    }
+    new_code->code = code;
+
+    CODE_BLOCK *last = data->last->code_block;
+    if (!last) {
+        data->last->code_block = new_code;
+    } else {
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = new_code;
+    }
+    return 0;
 }
 
 // Text callback - required by MD4C
 static int text_callback(MD_TEXTTYPE type, const MD_CHAR *text, MD_SIZE size,
                          void *userdata) {
-    CallbackData *data = (CallbackData *)userdata;
+    CallbackData *data    = (CallbackData *)userdata;
+    const char   *doc_end = data->doc + data->doc_size;
 
-    if (data->content == NULL) {
-        data->content = substr((char *)text, 0, size);
-        if (data->content == NULL) {
-            return -1;
+    if (skip_section(data) && data->block_type != MD_BLOCK_H) {
+        return 0;
+    }
+
+    if (!data->buffered) {
+        if (!data->content.text && text >= data->doc && text + size <= doc_end) {
+            data->content = (STR_VIEW){text, size};
+            return 0;
         }
-    } else {
-        char *new_text = substr((char *)text, 0, size);
-        if (new_text == NULL) {
-            return -1;
+
+        // A chunk that repeats the document bytes right after the view, such
+        // as the static "\n" md4c emits after each code line, extends it.
+        const char *end = data->content.text + data->content.size;
+        if (data->content.text && end + size <= doc_end && memcmp(end, text, size) == 0) {
+            data->content.size += size;
+            return 0;
         }
+    }
 
-        size_t len1 = strlen(data->content);
-        size_t len2 = size;
-        char  *temp = (char *)realloc(data->content, len1 + len2 + 1);
-        if (temp == NULL) {
-            free(new_text);
-            return -1;
+    // The text is split, so copy it out into the buffer.
+    if (reserve_buffer(data, data->content.size + size) != 0) {
+        return -1;
+    }
+    if (!data->buffered) {
+        if (data->content.size) {
+            memcpy(data->buffer, data->content.text, data->content.size);
         }
-        data->content = temp;
-        memcpy(data->content + len1, new_text, len2);
-        data->content[len1 + len2] = '\0';
-        free(new_text);
+        data->buffered     = 1;
+        data->content.text = data->buffer;
     }
+    memcpy(data->buffer + data->content.size, text, size);
+    data->content.size += size;
 
     return 0;
 }
@@ -369,8 +1047,7 @@ static int enter_block_callback(MD_BLOCKTYPE type, void *detail,
     CallbackData *data = (CallbackData *)userdata;
     data->block_type   = type;
 
-    free(data->content);
-    data->content = NULL;
+    reset_content(data);
 
     switch (type) {
         case MD_BLOCK_DOC:
@@ -397,6 +1074,10 @@ static int enter_block_callback(MD_BLOCKTYPE type, void *detail,
         case MD_BLOCK_H:
             if (detail) {
                 MD_BLOCK_H_DETAIL *d = (MD_BLOCK_H_DETAIL *)detail;
+                // Nothing after the target section can change the result
+                if (data->target_node && (int)d->level <= data->target_node->level) {
+                    return PARSE_STOPPED;
+                }
             }
             break;
         case MD_BLOCK_CODE:
@@ -455,25 +1136,12 @@ static int leave_block_callback(MD_BLOCKTYPE type, void *detail,
         case MD_BLOCK_HR:
             break;
         case MD_BLOCK_CODE:
-            if (detail && data->last && data->content) {
+            if (detail && data->last && data->content.text && !skip_section(data)) {
                 MD_BLOCK_CODE_DETAIL *c_detail = (MD_BLOCK_CODE_DETAIL *)detail;
-                char                 *info     = substr((char *)c_detail->info.text, 0, c_detail->info.size);
-
-                if (info) {
-                    // printf("Node: %s, content: %s\n", data->last->text, data->content);
-                    CODE_BLOCK *new_code = new_code_block(info);
-                    new_code->info       = info;
-                    new_code->code       = strdup(data->content);
-
-                    CODE_BLOCK *last = data->last->code_block;
-                    if (!last) {
-                        data->last->code_block = new_code;
-                    } else {
-                        while (last->next) {
-                            last = last->next;
-                        }
-                        last->next = new_code;
-                    }
+                STR_VIEW              info     = doc_view(data, c_detail->info.text, c_detail->info.size);
+
+                if (info.text && add_code_block(data, info, take_content(data)) != 0) {
+                    return -1;
                 }
             }
             break;
@@ -485,41 +1153,17 @@ static int leave_block_callback(MD_BLOCKTYPE type, void *detail,
         case MD_BLOCK_TBODY:
             break;
         case MD_BLOCK_H: {
-            MD_BLOCK_H_DETAIL *d        = (MD_BLOCK_H_DETAIL *)detail;
-            MD_NODE           *new_node = new_md_node();
-            new_node->level             = d->level;
+            MD_BLOCK_H_DETAIL *d = (MD_BLOCK_H_DETAIL *)detail;
             // Fix: Handle NULL content to prevent segfault on empty headings
-            new_node->text = data->content ? strdup(data->content) : "";
-
-            if (data->root == NULL) {
-                data->root = new_node;
-            } else {
-                if (d->level == data->last->level) {
-                    data->last->next = new_node;
-                    new_node->parent = data->last->parent;
-                } else if (d->level > data->last->level) {
-                    data->last->child = new_node;
-                    new_node->parent  = data->last;
-                } else if (d->level < data->last->level) {
-                    MD_NODE *parent = data->last->parent;
-                    while (parent) {
-                        if (parent->level == d->level) {
-                            parent->next     = new_node;
-                            new_node->parent = parent->parent;
-                            break;
-                        }
-                        parent = parent->parent;
-                    }
-                }
+            if (add_heading(data, (int)d->level, data->content.text ? take_content(data) : str_view("")) != 0) {
+                return -1;
             }
-            data->last = new_node;
             break;
         }
         case MD_BLOCK_P:
             // Make sure we have a node to attach to
-            if (data->last && !data->last->code_block) {
-                data->last->description =
-                    data->content == NULL ? NULL : strdup(data->content);
+            if (data->last && !data->last->code_block && !skip_section(data)) {
+                set_description(data->last, take_content(data));
             }
             break;
         case MD_BLOCK_TR:
@@ -534,8 +1178,7 @@ static int leave_block_callback(MD_BLOCKTYPE type, void *detail,
             break;
     }
 
-    free(data->content);
-    data->content = NULL;
+    reset_content(data);
 
     if (data->depth > 0) {
         data->depth--;
@@ -601,310 +1244,5192 @@ static int leave_span_callback(MD_SPANTYPE type, void *detail, void *userdata) {
     return 0;
 }
 
-MD_NODE *parse_file(char *file_path) {
-    FILE *fp = fopen(file_path, "rb");
-    if (!fp) {
-        error("Cannot open %s\n", file_path);
-        return NULL;
-    }
+// Fast scan
+//
+// With --fast-scan the doc is scanned line by line for what cr keeps:
+// headings, the paragraphs that become descriptions and fenced code blocks,
+// feeding the same add_heading() and add_code_block() as the md4c callbacks.
+// Anything the scanner cannot be sure to build as md4c does, such as block
+// quotes, HTML, loose lists or markup in a description, makes it give up,
+// and the doc is parsed with md4c instead.
 
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+enum { SCAN_NONE, SCAN_PARAGRAPH, SCAN_LIST, SCAN_INDENTED, SCAN_FENCE, SCAN_HTML };
 
-    if (size <= 0) {
-        fclose(fp);
-        error("Empty file: %s\n", file_path);
-        return NULL;
-    }
+typedef struct {
+    CallbackData *data;
+    const char   *reason; // Why the scan gave up
+    int           line_number;
+} SCANNER;
+
+static int scan_give_up(SCANNER *scanner, const char *reason) {
+    scanner->reason = reason;
+    return 1;
+}
 
-    // Allocate buffer and read file
-    char *buffer =
-        calloc(size + 1, 1); // Use calloc to ensure zero initialization
-    if (!buffer) {
-        fclose(fp);
-        error("Memory allocation failed\n");
-        return NULL;
+static size_t scan_spaces(const char *line, size_t size) {
+    size_t i = 0;
+    while (i < size && line[i] == ' ') {
+        i++;
     }
+    return i;
+}
 
-    size_t bytes_read  = fread(buffer, 1, size, fp);
-    buffer[bytes_read] = '\0';
-    fclose(fp);
-
-    if (bytes_read == 0) {
-        free(buffer);
-        error("Failed to read file\n");
-        return NULL;
+static int scan_is_blank(const char *line, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (line[i] != ' ' && line[i] != '\t') {
+            return 0;
+        }
     }
+    return 1;
+}
+
+// Length of the fence opening or closing line, or 0
+static size_t scan_fence(const char *line, size_t size, size_t indent) {
+    size_t i = indent;
+    while (i < size && line[i] == line[indent]) {
+        i++;
+    }
+    return indent <= 3 && (line[indent] == '`' || line[indent] == '~') && i - indent >= 3 ? i - indent : 0;
+}
+
+// Whether line is a thematic break, such as "---" or "* * *"
+static int scan_is_hr(const char *line, size_t size, size_t indent) {
+    char   c     = line[indent];
+    size_t count = 0;
+    if (indent > 3 || (c != '-' && c != '*' && c != '_')) {
+        return 0;
+    }
+    for (size_t i = indent; i < size; i++) {
+        if (line[i] == c) {
+            count++;
+        } else if (line[i] != ' ' && line[i] != '\t') {
+            return 0;
+        }
+    }
+    return count >= 3;
+}
+
+// Level of an ATX heading line, such as "## Build", or 0
+static int scan_atx_level(const char *line, size_t size, size_t indent) {
+    size_t hashes = 0;
+    while (indent + hashes < size && line[indent + hashes] == '#') {
+        hashes++;
+    }
+    if (indent > 3 || hashes == 0 || hashes > 6 || (indent + hashes < size && line[indent + hashes] != ' ')) {
+        return 0;
+    }
+    return (int)hashes;
+}
+
+// Level of a setext underline, "===" for 1 and "---" for 2, or 0
+static int scan_setext_level(const char *line, size_t size, size_t indent) {
+    char   c = line[indent];
+    size_t i = indent;
+    if (indent > 3 || (c != '=' && c != '-')) {
+        return 0;
+    }
+    while (i < size && line[i] == c) {
+        i++;
+    }
+    return scan_is_blank(line + i, size - i) ? (c == '=' ? 1 : 2) : 0;
+}
+
+// Whether line starts an HTML block that ends at a line containing *end, or
+// at a blank line if *end is NULL. Only comments, processing instructions
+// and block level tags are known, which can all interrupt a paragraph.
+static int scan_html_start(const char *line, size_t size, size_t indent, const char **end) {
+    static const char *tags[] = {
+        "address", "article", "aside", "blockquote", "body", "center", "details", "dialog", "div", "dl",
+        "fieldset", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header", "hr", "html",
+        "li", "main", "nav", "ol", "p", "section", "summary", "table", "tbody", "td", "th", "thead", "tr", "ul",
+    };
+
+    const char *html = line + indent;
+    size_t      rest = size - indent;
+    if (indent > 3 || rest < 2 || html[0] != '<') {
+        return 0;
+    }
+    if (rest >= 4 && memcmp(html, "<!--", 4) == 0) {
+        *end = "-->";
+        return 1;
+    }
+    if (html[1] == '?') {
+        *end = "?>";
+        return 1;
+    }
+
+    size_t name = html[1] == '/' ? 2 : 1;
+    size_t i    = name;
+    while (i < rest && isalnum((unsigned char)html[i])) {
+        i++;
+    }
+    if (i < rest && html[i] != ' ' && html[i] != '>' && !(html[i] == '/' && i + 1 < rest && html[i + 1] == '>')) {
+        return 0;
+    }
+    for (size_t t = 0; t < sizeof(tags) / sizeof(tags[0]); t++) {
+        if (strlen(tags[t]) == i - name && strncasecmp(html + name, tags[t], i - name) == 0) {
+            *end = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Whether the line ends an HTML block ending at *end
+static int scan_html_end(const char *line, size_t size, const char *end) {
+    size_t len = strlen(end);
+    for (size_t i = 0; i + len <= size; i++) {
+        if (memcmp(line + i, end, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Offset of the content of a list item line after its marker, or 0 if line
+// is not one. *number is the start of an ordered list, or -1.
+static size_t scan_list_item(const char *line, size_t size, size_t indent, long *number) {
+    size_t i = indent;
+    *number  = -1;
+    if (indent > 3 || i >= size) {
+        return 0;
+    }
+    if (line[i] == '-' || line[i] == '*' || line[i] == '+') {
+        i++;
+    } else {
+        long value = 0;
+        while (i < size && i - indent < 9 && isdigit((unsigned char)line[i])) {
+            value = value * 10 + (line[i++] - '0');
+        }
+        if (i == indent || i >= size || (line[i] != '.' && line[i] != ')')) {
+            return 0;
+        }
+        i++;
+        *number = value;
+    }
+    if (i < size && line[i] != ' ') {
+        return 0;
+    }
+    return i;
+}
+
+// Render the inline text of the lines between start and end as md4c
+// reports it: each line trimmed, joined by newlines, with code spans and
+// inline links reduced to their text. The result is a view when it is the
+// doc text itself. Returns 1 at markup the scanner does not render.
+static int scan_inline(SCANNER *scanner, const char *start, const char *end, STR_VIEW *out) {
+    CallbackData *data = scanner->data;
+    size_t        size = 0;
+    if (memchr(start, '\t', (size_t)(end - start))) {
+        return scan_give_up(scanner, "tab");
+    }
+    reset_content(data);
+    if (reserve_buffer(data, (size_t)(end - start) + 1) != 0) {
+        return -1;
+    }
+
+    for (const char *line = start; line < end;) {
+        const char *line_end = memchr(line, '\n', (size_t)(end - line));
+        const char *next     = line_end ? line_end + 1 : end;
+        line_end             = line_end ? line_end : end;
+        while (line < line_end && line[0] == ' ') {
+            line++;
+        }
+        while (line_end > line && (line_end[-1] == ' ' || line_end[-1] == '\t')) {
+            line_end--;
+        }
+        if (size) {
+            data->buffer[size++] = '\n';
+        }
+
+        for (const char *c = line; c < line_end; c++) {
+            switch (*c) {
+                case '`': {
+                    const char *run = c;
+                    while (c < line_end && *c == '`') {
+                        c++;
+                    }
+                    size_t      ticks = (size_t)(c - run);
+                    const char *close = c;
+                    int         found = 0;
+                    while (close < line_end && !found) {
+                        const char *close_run = close;
+                        while (close < line_end && *close == '`') {
+                            close++;
+                        }
+                        found = close_run < close && (size_t)(close - close_run) == ticks;
+                        close = close > close_run ? close : close + 1;
+                    }
+                    if (!found) {
+                        return scan_give_up(scanner, "unclosed code span");
+                    }
+                    const char *text      = c;
+                    const char *text_end  = close - ticks;
+                    int         all_space = scan_is_blank(text, (size_t)(text_end - text));
+                    if (text_end - text >= 2 && text[0] == ' ' && text_end[-1] == ' ' && !all_space) {
+                        text++;
+                        text_end--;
+                    }
+                    memcpy(data->buffer + size, text, (size_t)(text_end - text));
+                    size += (size_t)(text_end - text);
+                    c = close - 1;
+                    break;
+                }
+                case '[': {
+                    const char *text = c + 1;
+                    const char *text_end = text;
+                    while (text_end < line_end && !strchr("[]`\\*_<>&~!|", *text_end)) {
+                        text_end++;
+                    }
+                    const char *dest = text_end + 2;
+                    const char *dest_end = dest;
+                    while (dest_end < line_end && !strchr(" ()<>\\&\"'`", *dest_end)) {
+                        dest_end++;
+                    }
+                    if (text_end >= line_end || *text_end != ']' || dest > line_end || dest[-1] != '(' ||
+                        dest_end >= line_end || *dest_end != ')') {
+                        return scan_give_up(scanner, "link");
+                    }
+                    memcpy(data->buffer + size, text, (size_t)(text_end - text));
+                    size += (size_t)(text_end - text);
+                    c = dest_end;
+                    break;
+                }
+                case '_':
+                    // Only intraword, where it cannot be emphasis
+                    if (c == line || c + 1 == line_end || !isalnum((unsigned char)c[-1]) ||
+                        !isalnum((unsigned char)c[1])) {
+                        return scan_give_up(scanner, "emphasis");
+                    }
+                    data->buffer[size++] = *c;
+                    break;
+                case '!':
+                    if (c + 1 < line_end && c[1] == '[') {
+                        return scan_give_up(scanner, "image");
+                    }
+                    data->buffer[size++] = *c;
+                    break;
+                case '\\':
+                case '*':
+                case '<':
+                case '&':
+                case '~':
+                    return scan_give_up(scanner, "inline markup");
+                default:
+                    data->buffer[size++] = *c;
+                    break;
+            }
+        }
+        line = next;
+    }
+
+    // Keep a view where md4c would, the text being a single run of the doc
+    const char *first = start + scan_spaces(start, (size_t)(end - start));
+    if (size && (size_t)(end - first) >= size && memcmp(first, data->buffer, size) == 0) {
+        *out = (STR_VIEW){first, size};
+    } else if (size) {
+        char *copy = arena_memdup(data->arena, data->buffer, size);
+        if (!copy) {
+            return -1;
+        }
+        *out = (STR_VIEW){copy, size};
+    } else {
+        *out = (STR_VIEW){NULL, 0};
+    }
+    return 0;
+}
+
+// Close the paragraph between start and end, which describes the last
+// heading until it has code
+static int scan_paragraph(SCANNER *scanner, const char *start, const char *end) {
+    CallbackData *data = scanner->data;
+    if (!data->last || data->last->code_block) {
+        return 0;
+    }
+    if (*start == '[') {
+        return scan_give_up(scanner, "link reference definition");
+    }
+    STR_VIEW text;
+    int      result = scan_inline(scanner, start, end, &text);
+    if (result == 0 && text.text) {
+        set_description(data->last, text);
+    }
+    return result;
+}
+
+// Add the code between start and end of a fence with info. md4c writes the
+// leading whitespace of each line as spaces, to tab stops of 4, and ends
+// each line with a newline, even the last line of the doc.
+static int scan_code(SCANNER *scanner, STR_VIEW info, const char *start, const char *end) {
+    CallbackData *data = scanner->data;
+    if (!data->last || start == end) {
+        return 0;
+    }
+    STR_VIEW code = {start, (size_t)(end - start)};
+    if (memchr(start, '\t', (size_t)(end - start)) || end[-1] != '\n') {
+        size_t size = 0;
+        reset_content(data);
+        for (const char *line = start; line < end;) {
+            const char *line_end = memchr(line, '\n', (size_t)(end - line));
+            line_end             = line_end ? line_end : end;
+            size_t      indent   = 0;
+            const char *text     = line;
+            while (text < line_end && (*text == ' ' || *text == '\t')) {
+                indent = *text++ == '\t' ? (indent + 4) & ~(size_t)3 : indent + 1;
+            }
+            size_t line_size = (size_t)(line_end - text);
+            if (reserve_buffer(data, size + indent + line_size + 1) != 0) {
+                return -1;
+            }
+            memset(data->buffer + size, ' ', indent);
+            memcpy(data->buffer + size + indent, text, line_size);
+            size += indent + line_size;
+            data->buffer[size++] = '\n';
+            line                 = line_end + 1;
+        }
+        code.text = arena_memdup(data->arena, data->buffer, size);
+        code.size = size;
+        if (!code.text) {
+            return -1;
+        }
+    }
+    return add_code_block(data, info, code);
+}
+
+// Scan the doc into the tree of data. Returns 0, 1 if the scan gave up, or
+// -1 on errors.
+static int scan_doc(SCANNER *scanner) {
+    CallbackData *data = scanner->data;
+    const char   *doc  = data->doc;
+    const char   *end  = doc + data->doc_size;
+    if (memchr(doc, '\r', data->doc_size) || memchr(doc, '\0', data->doc_size)) {
+        return scan_give_up(scanner, "CR or NUL");
+    }
+
+    int         state      = SCAN_NONE;
+    const char *para_start = NULL;
+    const char *para_end   = NULL;
+    int         para_lines = 0;
+    int         list_blank = 0;
+    char        fence_char = 0;
+    size_t      fence_size = 0;
+    STR_VIEW    info       = {NULL, 0};
+    const char *code_start = NULL;
+    const char *html_end   = NULL;
+    int         result     = 0;
+
+    for (const char *line = doc; line < end && result == 0;) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        const char *next    = newline ? newline + 1 : end;
+        size_t      size    = (size_t)((newline ? newline : end) - line);
+        size_t      indent  = scan_spaces(line, size);
+        int         blank   = scan_is_blank(line, size);
+        scanner->line_number++;
+
+        if (state == SCAN_FENCE) {
+            size_t fence = scan_fence(line, size, indent);
+            if (fence >= fence_size && line[indent] == fence_char &&
+                scan_is_blank(line + indent + fence, size - indent - fence)) {
+                result = info.text ? scan_code(scanner, info, code_start, line) : 0;
+                state  = SCAN_NONE;
+            } else if (!newline) {
+                result = info.text ? scan_code(scanner, info, code_start, end) : 0;
+                state  = SCAN_NONE; // The fence is closed by the end of the doc
+            }
+            line = next;
+            continue;
+        }
+        if (state == SCAN_HTML) {
+            if (html_end ? scan_html_end(line, size, html_end) : blank) {
+                state = SCAN_NONE;
+            }
+            line = next;
+            continue;
+        }
+        if (!blank && indent < size && line[indent] == '\t') {
+            return scan_give_up(scanner, "tab indentation");
+        }
+
+        if (blank) {
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+                state  = SCAN_NONE;
+            } else if (state == SCAN_LIST) {
+                list_blank = 1;
+            }
+            line = next;
+            continue;
+        }
+
+        long   number;
+        size_t item = scan_list_item(line, size, indent, &number);
+        if (state == SCAN_LIST) {
+            if (indent >= 2 || item) {
+                size_t content = item ? item + scan_spaces(line + item, size - item) : indent;
+                char   c       = content < size ? line[content] : '\0';
+                if (list_blank || (item && (content - item > 4 || content == size || number > 1)) ||
+                    strchr("#`~><|=", c) || scan_is_hr(line, size, content) ||
+                    scan_setext_level(line, size, content)) {
+                    return scan_give_up(scanner, "list item content");
+                }
+                line = next;
+                continue;
+            }
+            if (!list_blank && scan_setext_level(line, size, indent)) {
+                return scan_give_up(scanner, "setext underline in a list");
+            }
+            if (!list_blank && !scan_is_hr(line, size, indent) && !scan_fence(line, size, indent) &&
+                !scan_atx_level(line, size, indent) && line[indent] != '>' && line[indent] != '<') {
+                line = next; // Lazy continuation of the item
+                continue;
+            }
+            state      = SCAN_NONE;
+            list_blank = 0;
+        }
+        if (state == SCAN_INDENTED) {
+            if (indent >= 4) {
+                line = next;
+                continue;
+            }
+            state = SCAN_NONE;
+        }
+
+        if (indent >= 4) {
+            if (state == SCAN_NONE) {
+                state = SCAN_INDENTED; // Indented code, which has no info
+            } else if (memchr(line, '|', size)) {
+                return scan_give_up(scanner, "table");
+            } else {
+                para_end = newline ? newline : end;
+                para_lines++;
+            }
+            line = next;
+            continue;
+        }
+
+        char   c      = line[indent];
+        size_t fence  = scan_fence(line, size, indent);
+        int    setext = state == SCAN_PARAGRAPH ? scan_setext_level(line, size, indent) : 0;
+        int    atx    = scan_atx_level(line, size, indent);
+
+        if (setext) {
+            if (para_lines != 1) {
+                return scan_give_up(scanner, "multi-line setext heading");
+            }
+            STR_VIEW text;
+            result = scan_inline(scanner, para_start, para_end, &text);
+            if (result == 0) {
+                result = add_heading(data, setext, text.text ? text : str_view(""));
+            }
+            state = SCAN_NONE;
+        } else if (fence) {
+            STR_VIEW rest = {line + indent + fence, size - indent - fence};
+            if (c == '`' && memchr(rest.text, '`', rest.size)) {
+                return scan_give_up(scanner, "backtick in info");
+            }
+            if (indent > 0 || memchr(rest.text, '\t', rest.size) || memchr(rest.text, '\\', rest.size) ||
+                memchr(rest.text, '&', rest.size)) {
+                return scan_give_up(scanner, "fence");
+            }
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+            }
+            while (rest.size && rest.text[0] == ' ') {
+                rest.text++;
+                rest.size--;
+            }
+            while (rest.size && rest.text[rest.size - 1] == ' ') {
+                rest.size--;
+            }
+            info       = rest.size ? rest : (STR_VIEW){NULL, 0};
+            fence_char = c;
+            fence_size = fence;
+            code_start = next;
+            state      = SCAN_FENCE;
+        } else if (atx) {
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+            }
+            // The text, without a closing sequence of '#'
+            const char *text     = line + indent + atx;
+            const char *text_end = line + size;
+            while (text < text_end && *text == ' ') {
+                text++;
+            }
+            while (text_end > text && text_end[-1] == ' ') {
+                text_end--;
+            }
+            const char *closing = text_end;
+            while (closing > text && closing[-1] == '#') {
+                closing--;
+            }
+            if (closing == text || closing[-1] == ' ') {
+                text_end = closing;
+                while (text_end > text && text_end[-1] == ' ') {
+                    text_end--;
+                }
+            }
+            STR_VIEW heading = {NULL, 0};
+            if (result == 0 && text < text_end) {
+                result = scan_inline(scanner, text, text_end, &heading);
+            }
+            if (result == 0) {
+                result = add_heading(data, atx, heading.text ? heading : str_view(""));
+            }
+            state = SCAN_NONE;
+        } else if (scan_is_hr(line, size, indent)) {
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+            }
+            state = SCAN_NONE;
+        } else if (scan_html_start(line, size, indent, &html_end)) {
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+            }
+            size_t open = line[indent + 1] == '?' ? 2 : 4;
+            state       = html_end && scan_html_end(line + indent + open, size - indent - open, html_end) ? SCAN_NONE : SCAN_HTML;
+        } else if (c == '>' || c == '<') {
+            return scan_give_up(scanner, c == '>' ? "block quote" : "HTML");
+        } else if (item) {
+            size_t content = item + scan_spaces(line + item, size - item);
+            if (state == SCAN_PARAGRAPH && (content == size || (number >= 0 && number != 1))) {
+                return scan_give_up(scanner, "list item in a paragraph");
+            }
+            if (content == size || content - item > 4 || strchr("#`~><|", line[content]) ||
+                scan_is_hr(line, size, content)) {
+                return scan_give_up(scanner, "list item content");
+            }
+            if (state == SCAN_PARAGRAPH) {
+                result = scan_paragraph(scanner, para_start, para_end);
+            }
+            state      = SCAN_LIST;
+            list_blank = 0;
+        } else if (memchr(line, '|', size)) {
+            return scan_give_up(scanner, "table");
+        } else if (state == SCAN_PARAGRAPH) {
+            para_end = newline ? newline : end;
+            para_lines++;
+        } else {
+            state      = SCAN_PARAGRAPH;
+            para_start = line;
+            para_end   = newline ? newline : end;
+            para_lines = 1;
+        }
+        line = next;
+    }
+
+    if (result == 0 && state == SCAN_PARAGRAPH) {
+        result = scan_paragraph(scanner, para_start, para_end);
+    } else if (result == 0 && state == SCAN_FENCE && info.text) {
+        result = scan_code(scanner, info, code_start, end);
+    }
+    return result;
+}
+
+// Parse the doc into a tree allocated from the doc's arena. With a target heading, only
+// the section of that heading is built fully and the rest of the doc after it
+// is not parsed at all.
+MD_NODE *parse_file(char *file_path, MD_DOC *doc, const char *target) {
+    TimingMark mark;
+    timing_start(&mark);
+
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        error("Cannot open %s\n", file_path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        error("Empty file: %s\n", file_path);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+
+    // Map the doc read-only. The mapping is kept until free_doc(), node
+    // texts and code blocks are views into it.
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // Fault the doc in up front so reading it is timed apart from parsing
+    if (timing_enabled()) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    char *buffer = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        error("Failed to read file\n");
+        return NULL;
+    }
+    doc->map      = buffer;
+    doc->map_size = size;
+    timing_end(&mark, "parse_file: io");
 
     // Initialize callback data
-    CallbackData data = {.depth = 0, .root = NULL, .last = NULL};
+    CallbackData data = {.depth = 0, .root = NULL, .last = NULL, .doc = buffer, .doc_size = size, .arena = &doc->arena, .index = &doc->index, .target = target};
+
+    // Initialize parser with complete callback structure
+    MD_PARSER parser   = {0}; // Zero initialize all fields
+    parser.abi_version = 0;
+    parser.flags       = MD_DIALECT_GITHUB;
+    parser.enter_block = enter_block_callback;
+    parser.leave_block = leave_block_callback;
+    parser.enter_span  = enter_span_callback;
+    parser.leave_span  = leave_span_callback;
+    parser.text        = text_callback;
+
+    int result = 1;
+    if (config.fast_scan) {
+        // The scan builds the whole tree, and is undone when it gives up
+        SCANNER scanner = {.data = &data};
+        data.target     = NULL;
+        timing_start(&mark);
+        result = scan_doc(&scanner);
+        timing_end(&mark, "parse_file: scan");
+        if (result == 1) {
+            log_info("Fast scan fell back to md4c at line %d: %s\n", scanner.line_number, scanner.reason);
+            arena_free(&doc->arena);
+            free(doc->index.slots);
+            doc->index      = (HEADING_INDEX){0};
+            data.root       = NULL;
+            data.last       = NULL;
+            data.node_count = 0;
+            data.target     = target;
+        }
+    }
+
+    if (result == 1) {
+        timing_start(&mark);
+        result = md_parse(buffer, size, &parser, &data);
+        timing_end(&mark, "parse_file: md4c");
+    }
+
+    if (result == PARSE_STOPPED) {
+        log_info("Stopped parsing after target section\n");
+    } else if (result != 0) {
+        error("Markdown parsing failed with code %d\n", result);
+        // } else {
+        //     error( "Parsing completed successfully\n");
+    }
+
+    free(data.buffer);
+    return data.root;
+}
+
+// AST cache
+//
+// The parsed heading tree is stored under $XDG_CACHE_HOME/cr, one file per
+// document, keyed by the document's real path. The file holds a fixed header
+// with the stat key of the document, followed by flat node and code block
+// records that link to each other by index, followed by a string pool. A hit
+// maps the file read-only and points the node views straight into the
+// mapping, so md4c is not run at all.
+
+#define CACHE_MAGIC   "CRAST\0\0\0"
+#define CACHE_VERSION 5
+#define CACHE_NONE    UINT32_MAX
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+// Modification time of st, to the nanosecond where there is one
+static struct timespec stat_mtime(const struct stat *st) {
+    struct timespec mtime = {st->st_mtime, ST_MTIME_NSEC(st)};
+    return mtime;
+}
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t block_count;
+    uint32_t path_size; // including the NUL, padded to keep records aligned
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint64_t strings_size;
+} CACHE_HEADER;
+
+typedef struct {
+    uint32_t offset; // CACHE_NONE for an absent view
+    uint32_t size;
+} CACHE_STR;
+
+typedef struct {
+    int32_t   level;
+    CACHE_STR text;
+    CACHE_STR description;
+    CACHE_STR deps;
+    CACHE_STR inputs;
+    CACHE_STR outputs;
+    CACHE_STR limits;
+    uint32_t  code_block;
+    uint32_t  next;
+    uint32_t  parent;
+    uint32_t  child;
+} CACHE_NODE;
+
+typedef struct {
+    CACHE_STR info;
+    CACHE_STR code;
+    uint32_t  next;
+} CACHE_BLOCK;
+
+typedef struct {
+    CACHE_NODE  *nodes;
+    CACHE_BLOCK *blocks;
+    char        *strings;
+    uint32_t     node_count;
+    uint32_t     block_count;
+    uint64_t     strings_size;
+} CacheWriter;
+
+static uint64_t fnv1a_64(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Create every missing directory in path, like `mkdir -p`.
+static int mkdir_p(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                *p = '/';
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Resolve the cache directory, `$XDG_CACHE_HOME/cr` or `$HOME/.cache/cr`.
+static int get_cache_dir(char *buf, size_t size) {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home           = getenv("HOME");
+    int         n;
+    if (xdg_cache_home && xdg_cache_home[0] == '/') {
+        n = snprintf(buf, size, "%s/cr", xdg_cache_home);
+    } else if (home && *home) {
+        n = snprintf(buf, size, "%s/.cache/cr", home);
+    } else {
+        return -1;
+    }
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+static int get_cache_path(const char *doc_real_path, char *buf, size_t size) {
+    char dir[PATH_MAX];
+    if (get_cache_dir(dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    int n = snprintf(buf, size, "%s/%016llx.ast", dir, (unsigned long long)fnv1a_64(doc_real_path));
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+static CACHE_STR cache_intern(CacheWriter *w, STR_VIEW view) {
+    CACHE_STR str = {CACHE_NONE, 0};
+    if (!view.text) {
+        return str;
+    }
+    str.offset = (uint32_t)w->strings_size;
+    str.size   = (uint32_t)view.size;
+    if (w->strings) {
+        memcpy(w->strings + str.offset, view.text, view.size);
+    }
+    w->strings_size += view.size;
+    return str;
+}
+
+// Flatten the tree in document order. Run once with empty arrays to count
+// records and string bytes, then again to fill them in.
+static uint32_t cache_flatten(CacheWriter *w, MD_NODE *node, uint32_t parent) {
+    uint32_t first = CACHE_NONE;
+    uint32_t prev  = CACHE_NONE;
+    for (; node; node = node->next) {
+        uint32_t index = w->node_count++;
+        if (w->nodes) {
+            CACHE_NODE *record  = &w->nodes[index];
+            record->level       = node->level;
+            record->text        = cache_intern(w, node->text);
+            record->description = cache_intern(w, node->description);
+            record->deps        = cache_intern(w, node->deps);
+            record->inputs      = cache_intern(w, node->inputs);
+            record->outputs     = cache_intern(w, node->outputs);
+            record->limits      = cache_intern(w, node->limits);
+            record->code_block  = CACHE_NONE;
+            record->next        = CACHE_NONE;
+            record->parent      = parent;
+
+            uint32_t prev_block = CACHE_NONE;
+            for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+                uint32_t     block_index = w->block_count++;
+                CACHE_BLOCK *block_rec   = &w->blocks[block_index];
+                block_rec->info          = cache_intern(w, block->info);
+                block_rec->code          = cache_intern(w, block->code);
+                block_rec->next          = CACHE_NONE;
+                if (prev_block == CACHE_NONE) {
+                    record->code_block = block_index;
+                } else {
+                    w->blocks[prev_block].next = block_index;
+                }
+                prev_block = block_index;
+            }
+            if (prev != CACHE_NONE) {
+                w->nodes[prev].next = index;
+            }
+        } else {
+            cache_intern(w, node->text);
+            cache_intern(w, node->description);
+            cache_intern(w, node->deps);
+            cache_intern(w, node->inputs);
+            cache_intern(w, node->outputs);
+            cache_intern(w, node->limits);
+            for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+                w->block_count++;
+                cache_intern(w, block->info);
+                cache_intern(w, block->code);
+            }
+        }
+        if (first == CACHE_NONE) {
+            first = index;
+        }
+        prev = index;
+
+        uint32_t child = cache_flatten(w, node->child, index);
+        if (w->nodes) {
+            w->nodes[index].child = child;
+        }
+    }
+    return first;
+}
+
+static int write_all(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// Write the cache of root, parsed from the doc at real_path with st, to fd
+static int write_cache(int fd, const char *real_path, const struct stat *st, MD_NODE *root) {
+    char padded_path[PATH_MAX + 8] = {0};
+    strcpy(padded_path, real_path);
+
+    CacheWriter counter = {0};
+    cache_flatten(&counter, root, CACHE_NONE);
+
+    int         failed = -1;
+    CacheWriter writer = {0};
+    writer.nodes       = calloc(counter.node_count ? counter.node_count : 1, sizeof(CACHE_NODE));
+    writer.blocks      = calloc(counter.block_count ? counter.block_count : 1, sizeof(CACHE_BLOCK));
+    writer.strings     = malloc(counter.strings_size ? counter.strings_size : 1);
+    if (!writer.nodes || !writer.blocks || !writer.strings || counter.strings_size >= CACHE_NONE) {
+        goto cleanup;
+    }
+    cache_flatten(&writer, root, CACHE_NONE);
+
+    CACHE_HEADER header = {0};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version      = CACHE_VERSION;
+    header.node_count   = writer.node_count;
+    header.block_count  = writer.block_count;
+    header.path_size    = (uint32_t)((strlen(real_path) + 8) & ~(size_t)7);
+    header.dev          = (uint64_t)st->st_dev;
+    header.ino          = (uint64_t)st->st_ino;
+    header.size         = (uint64_t)st->st_size;
+    header.mtime_sec    = (int64_t)st->st_mtime;
+    header.mtime_nsec   = (int64_t)ST_MTIME_NSEC(st);
+    header.strings_size = writer.strings_size;
+
+    failed = write_all(fd, &header, sizeof(header)) ||
+             write_all(fd, padded_path, header.path_size) ||
+             write_all(fd, writer.nodes, sizeof(CACHE_NODE) * writer.node_count) ||
+             write_all(fd, writer.blocks, sizeof(CACHE_BLOCK) * writer.block_count) ||
+             write_all(fd, writer.strings, writer.strings_size);
+
+cleanup:
+    free(writer.nodes);
+    free(writer.blocks);
+    free(writer.strings);
+    return failed ? -1 : 0;
+}
+
+void save_cache(const char *doc_path, MD_NODE *root) {
+    char        real_path[PATH_MAX];
+    char        cache_path[PATH_MAX];
+    char        tmp_path[PATH_MAX + 32];
+    struct stat st;
+
+    if (!realpath(doc_path, real_path) || stat(real_path, &st) != 0) {
+        return;
+    }
+    if (get_cache_path(real_path, cache_path, sizeof(cache_path)) != 0) {
+        return;
+    }
+
+    char *dir = strdup(cache_path);
+    if (!dir) {
+        return;
+    }
+    int dir_ok = mkdir_p(dirname(dir)) == 0;
+    free(dir);
+    if (!dir_ok) {
+        log_info("Cannot create cache dir for %s\n", cache_path);
+        return;
+    }
+
+    // Write to a temporary file and rename it, so readers never see a
+    // partially written cache.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache_path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    int failed = write_cache(fd, real_path, &st, root);
+    if (close(fd) != 0 || failed || rename(tmp_path, cache_path) != 0) {
+        unlink(tmp_path);
+        return;
+    }
+    log_info("Saved cache: %s\n", cache_path);
+}
+
+// Map the cache in fd into doc, if it is of the doc at real_path with st.
+// Returns the root node, or NULL if the cache is stale or broken.
+static MD_NODE *map_cache(int fd, const char *real_path, const struct stat *st, MD_DOC *doc) {
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) != 0 || (size_t)cache_st.st_size < sizeof(CACHE_HEADER)) {
+        return NULL;
+    }
+    size_t map_size = (size_t)cache_st.st_size;
+    char  *map      = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const CACHE_HEADER *header = (const CACHE_HEADER *)map;
+    size_t              path_size;
+    const char         *path;
+    const CACHE_NODE   *node_recs;
+    const CACHE_BLOCK  *block_recs;
+    const char         *strings;
+
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CACHE_VERSION ||
+        header->dev != (uint64_t)st->st_dev ||
+        header->ino != (uint64_t)st->st_ino ||
+        header->size != (uint64_t)st->st_size ||
+        header->mtime_sec != (int64_t)st->st_mtime ||
+        header->mtime_nsec != (int64_t)ST_MTIME_NSEC(st)) {
+        goto stale;
+    }
+
+    path_size = header->path_size;
+    if (path_size == 0 || path_size % 8 != 0 ||
+        sizeof(CACHE_HEADER) + path_size + sizeof(CACHE_NODE) * (uint64_t)header->node_count +
+            sizeof(CACHE_BLOCK) * (uint64_t)header->block_count + header->strings_size !=
+        map_size) {
+        goto stale;
+    }
+    path = map + sizeof(CACHE_HEADER);
+    if (path[path_size - 1] != '\0' || strcmp(path, real_path) != 0) {
+        goto stale;
+    }
+    node_recs  = (const CACHE_NODE *)(path + path_size);
+    block_recs = (const CACHE_BLOCK *)(node_recs + header->node_count);
+    strings    = (const char *)(block_recs + header->block_count);
+
+    if (header->node_count == 0) {
+        goto stale;
+    }
+
+#define CACHE_BAD(str)              ((str).offset != CACHE_NONE && (uint64_t)(str).offset + (str).size > header->strings_size)
+#define CACHE_VIEW(str)             ((str).offset == CACHE_NONE ? (STR_VIEW){NULL, 0} : (STR_VIEW){strings + (str).offset, (str).size})
+#define CACHE_REF(array, index, n)  ((index) < (n) ? &(array)[index] : NULL)
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        if (CACHE_BAD(node_recs[i].text) || CACHE_BAD(node_recs[i].description) || CACHE_BAD(node_recs[i].deps) ||
+            CACHE_BAD(node_recs[i].inputs) || CACHE_BAD(node_recs[i].outputs) || CACHE_BAD(node_recs[i].limits)) {
+            goto stale;
+        }
+    }
+    for (uint32_t i = 0; i < header->block_count; i++) {
+        if (CACHE_BAD(block_recs[i].info) || CACHE_BAD(block_recs[i].code)) {
+            goto stale;
+        }
+    }
+
+    // One array each, so the nodes sit next to each other in document order
+    MD_NODE    *nodes  = arena_calloc(&doc->arena, header->node_count, sizeof(MD_NODE));
+    CODE_BLOCK *blocks = arena_calloc(&doc->arena, header->block_count, sizeof(CODE_BLOCK));
+    if (!nodes || !blocks) {
+        goto stale;
+    }
+
+    for (uint32_t i = 0; i < header->node_count; i++) {
+        const CACHE_NODE *record = &node_recs[i];
+        nodes[i].level           = record->level;
+        nodes[i].text            = CACHE_VIEW(record->text);
+        nodes[i].description     = CACHE_VIEW(record->description);
+        nodes[i].deps            = CACHE_VIEW(record->deps);
+        nodes[i].inputs          = CACHE_VIEW(record->inputs);
+        nodes[i].outputs         = CACHE_VIEW(record->outputs);
+        nodes[i].limits          = CACHE_VIEW(record->limits);
+        nodes[i].code_block      = CACHE_REF(blocks, record->code_block, header->block_count);
+        nodes[i].next            = CACHE_REF(nodes, record->next, header->node_count);
+        nodes[i].parent          = CACHE_REF(nodes, record->parent, header->node_count);
+        nodes[i].child           = CACHE_REF(nodes, record->child, header->node_count);
+        nodes[i].order           = i;
+        if (index_add(&doc->index, &nodes[i]) != 0) {
+            goto stale;
+        }
+    }
+    for (uint32_t i = 0; i < header->block_count; i++) {
+        const CACHE_BLOCK *record = &block_recs[i];
+        blocks[i].info            = CACHE_VIEW(record->info);
+        blocks[i].code            = CACHE_VIEW(record->code);
+        blocks[i].next            = CACHE_REF(blocks, record->next, header->block_count);
+    }
+#undef CACHE_BAD
+#undef CACHE_VIEW
+#undef CACHE_REF
+
+    // The mapping stays alive until free_doc(), the node strings point
+    // into it.
+    doc->map      = map;
+    doc->map_size = map_size;
+    return &nodes[0];
+
+stale:
+    munmap(map, map_size);
+    return NULL;
+}
+
+MD_NODE *load_cache(const char *doc_path, MD_DOC *doc) {
+    char        real_path[PATH_MAX];
+    char        cache_path[PATH_MAX];
+    struct stat st;
+
+    if (!realpath(doc_path, real_path) || stat(real_path, &st) != 0) {
+        return NULL;
+    }
+    if (get_cache_path(real_path, cache_path, sizeof(cache_path)) != 0) {
+        return NULL;
+    }
+
+    int fd = open(cache_path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    MD_NODE *root = map_cache(fd, real_path, &st, doc);
+    close(fd);
+    if (root) {
+        log_info("Loaded cache: %s\n", cache_path);
+    }
+    return root;
+}
+
+// Snapshot
+//
+// Code blocks that run ${CR} get the parsed tree of their doc in a sealed
+// memfd, in the format of the AST cache. Its fd is inherited, and named by
+// CR_DOC_FD, so that a nested cr on the same doc maps it instead of
+// parsing. The stat key of the doc is checked as for the cache.
+
+// Map the snapshot of CR_DOC_FD into doc, if it is of the doc at doc_path
+static MD_NODE *load_snapshot(const char *doc_path, MD_DOC *doc) {
+    const char *value = getenv("CR_DOC_FD");
+    char       *end;
+    char        real_path[PATH_MAX];
+    struct stat st;
+    if (!value || !*value) {
+        return NULL;
+    }
+    long fd = strtol(value, &end, 10);
+    if (*end || fd < 0 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0 || !realpath(doc_path, real_path) ||
+        stat(real_path, &st) != 0) {
+        return NULL;
+    }
+    MD_NODE *root = map_cache((int)fd, real_path, &st, doc);
+    if (root) {
+        doc->from_snapshot = 1;
+        log_info("Loaded snapshot: fd %ld\n", fd);
+    }
+    return root;
+}
+
+// Publish the parsed tree of the doc at doc_path to the code blocks about to
+// run, unless it came from the snapshot they would inherit anyway, or is
+// partial and would hide the headings after its target from them
+static void export_snapshot(const char *doc_path, MD_DOC *doc) {
+#ifdef MFD_ALLOW_SEALING
+    char        real_path[PATH_MAX];
+    struct stat st;
+    if (doc->from_snapshot || doc->partial || !realpath(doc_path, real_path) || stat(real_path, &st) != 0) {
+        return;
+    }
+    int fd = memfd_create("cr-doc", MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return;
+    }
+    if (write_cache(fd, real_path, &st, doc->root) != 0) {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv("CR_DOC_FD", value, 1);
+    log_info("Exported snapshot: fd %d\n", fd);
+#else
+    (void)doc_path;
+    (void)doc;
+#endif
+}
+
+// Parse the doc, going through the AST cache unless it is disabled. A miss
+// parses the whole doc to fill the cache, a targeted parse is only done for
+// target when the result cannot be cached anyway.
+MD_NODE *load_doc(char *file_path, MD_DOC *doc, const char *target) {
+    char cache_dir[PATH_MAX];
+    int  use_cache = !config.no_cache && get_cache_dir(cache_dir, sizeof(cache_dir)) == 0;
+
+    TimingMark mark;
+    if (!config.no_cache && !config.rebuild_cache && getenv("CR_DOC_FD")) {
+        timing_start(&mark);
+        MD_NODE *root = load_snapshot(file_path, doc);
+        timing_end(&mark, "load_snapshot");
+        if (root) {
+            doc->root = root;
+            return root;
+        }
+        free_doc(doc);
+    }
+    if (use_cache && !config.rebuild_cache) {
+        timing_start(&mark);
+        MD_NODE *root = load_cache(file_path, doc);
+        timing_end(&mark, "load_cache");
+        if (root) {
+            doc->root = root;
+            return root;
+        }
+        free_doc(doc);
+    }
+
+    MD_NODE *root = parse_file(file_path, doc, use_cache ? NULL : target);
+    doc->root     = root;
+    doc->partial  = root && !use_cache && target;
+    if (root && use_cache) {
+        timing_start(&mark);
+        save_cache(file_path, root);
+        timing_end(&mark, "save_cache");
+    }
+    return root;
+}
+
+// Workspace
+//
+// Several docs, from more than one -f or from a glob, are parsed at once on
+// a pool of threads, each taking the next doc into its own MD_DOC, and are
+// then merged into the forest of the global doc. Each doc hangs under a
+// level 0 node named after its dir, so that "pkg/build" is the heading
+// build anywhere in the doc of pkg. Dirs with the same name are told apart
+// by the dirs above them, as in "a/pkg/build" and "b/pkg/build".
+
+typedef struct {
+    char    *path;
+    MD_DOC   doc;
+    MD_NODE *node; // Namespace node of the doc in the forest
+} WORKSPACE_DOC;
+
+static WORKSPACE_DOC *workspace;
+static size_t         workspace_count;
+static size_t         workspace_next; // Next doc for a thread to parse
+
+static void *parse_workspace_docs(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&workspace_next, 1, __ATOMIC_RELAXED);
+        if (i >= workspace_count) {
+            return NULL;
+        }
+        if (!load_doc(workspace[i].path, &workspace[i].doc, NULL)) {
+            error("Failed to parse file: %s\n", workspace[i].path);
+        }
+    }
+}
+
+// Dir of the doc at path
+static char *workspace_dir(const char *path) {
+    char  real_path[PATH_MAX];
+    char *dir = realpath(path, real_path) ? dirname(real_path) : NULL;
+    if (!dir) {
+        snprintf(real_path, sizeof(real_path), "%s", path);
+        dir = dirname(real_path);
+    }
+    return strdup(dir);
+}
+
+// The last count components of dir
+static const char *dir_suffix(const char *dir, size_t count) {
+    const char *end   = dir + strlen(dir);
+    const char *start = end;
+    for (; count && start > dir; count--) {
+        if (start < end) {
+            start--;
+        }
+        while (start > dir && start[-1] != '/') {
+            start--;
+        }
+    }
+    return *start ? start : dir;
+}
+
+// Name the doc of each dir with the fewest components of it no other dir
+// ends with, as views into the forest arena. Two docs in one dir are an
+// error.
+static int namespace_names(char **dirs, size_t count, STR_VIEW *names) {
+    for (size_t i = 0; i < count; i++) {
+        const char *name = dirs[i];
+        for (size_t components = 1; components <= strlen(dirs[i]); components++) {
+            name       = dir_suffix(dirs[i], components);
+            int shared = 0;
+            for (size_t j = 0; j < count && !shared; j++) {
+                if (j != i && strcasecmp(dirs[j], dirs[i]) == 0) {
+                    error("More than one doc in %s\n", dirs[i]);
+                    return -1;
+                }
+                shared = j != i && strcasecmp(dir_suffix(dirs[j], components), name) == 0;
+            }
+            if (!shared) {
+                break;
+            }
+        }
+        char *copy = arena_memdup(&doc.arena, name, strlen(name));
+        if (!copy) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        names[i] = (STR_VIEW){copy, strlen(name)};
+    }
+    return 0;
+}
+
+// Number the nodes from node on in document order, and index them
+static int index_forest(MD_NODE *node, unsigned int *order) {
+    for (; node; node = node->next) {
+        node->order     = (*order)++;
+        node->next_same = NULL;
+        if (index_add(&doc.index, node) != 0 || index_forest(node->child, order) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Parse the docs of paths into the forest of the global doc. Returns its
+// root, or NULL if no doc could be parsed.
+MD_NODE *load_workspace(char **paths, size_t count) {
+    workspace = calloc(count, sizeof(WORKSPACE_DOC));
+    if (!workspace) {
+        error("Memory allocation failed\n");
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        workspace[i].path = paths[i];
+    }
+    workspace_count = count;
+
+    TimingMark mark;
+    timing_start(&mark);
+    long      cpus         = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t    thread_count = cpus > 1 ? (size_t)cpus : 1;
+    thread_count           = thread_count < count ? thread_count : count;
+    pthread_t threads[thread_count];
+    size_t    started = 0;
+    // The main thread takes docs too
+    while (started + 1 < thread_count && pthread_create(&threads[started], NULL, parse_workspace_docs, NULL) == 0) {
+        started++;
+    }
+    parse_workspace_docs(NULL);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    timing_end(&mark, "load_workspace");
+    log_info("Parsed %zu docs on %zu threads\n", count, started + 1);
+
+    char   **dirs  = calloc(count, sizeof(char *));
+    STR_VIEW *names = calloc(count, sizeof(STR_VIEW));
+    int       named = dirs && names;
+    for (size_t i = 0; named && i < count; i++) {
+        named = (dirs[i] = workspace_dir(paths[i])) != NULL;
+    }
+    if (!named) {
+        error("Memory allocation failed\n");
+    }
+    named = named && namespace_names(dirs, count, names) == 0;
+    for (size_t i = 0; dirs && i < count; i++) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    if (!named) {
+        free(names);
+        return NULL;
+    }
+
+    MD_NODE     *last  = NULL;
+    unsigned int order = 0;
+    for (size_t i = 0; i < count; i++) {
+        MD_NODE *root = workspace[i].doc.root;
+        if (!root) {
+            continue;
+        }
+        MD_NODE *node = new_md_node(&doc.arena);
+        if (!node) {
+            error("Memory allocation failed\n");
+            free(names);
+            return NULL;
+        }
+        node->text  = names[i];
+        node->child = root;
+        for (MD_NODE *top = root; top; top = top->next) {
+            top->parent = node;
+        }
+        if (last) {
+            last->next = node;
+        } else {
+            doc.root = node;
+        }
+        last              = node;
+        workspace[i].node = node;
+    }
+    free(names);
+    if (index_forest(doc.root, &order) != 0) {
+        error("Memory allocation failed\n");
+        return NULL;
+    }
+    return doc.root;
+}
+
+// Doc of the workspace that node is in, or NULL outside of a workspace
+static WORKSPACE_DOC *workspace_doc(MD_NODE *node) {
+    while (node->parent) {
+        node = node->parent;
+    }
+    for (size_t i = 0; i < workspace_count; i++) {
+        if (workspace[i].node == node) {
+            return &workspace[i];
+        }
+    }
+    return NULL;
+}
+
+// The first node rest names inside the doc of namespace_node
+static MD_NODE *find_in_namespace(MD_DOC *doc, MD_NODE *namespace_node, const char *rest) {
+    const char *end = rest + strlen(rest);
+    while (end > rest && end[-1] == '/') {
+        end--;
+    }
+    const char *last = end;
+    while (last > rest && last[-1] != '/') {
+        last--;
+    }
+
+    for (MD_NODE *node = index_get(&doc->index, (STR_VIEW){last, (size_t)(end - last)}); node;
+         node = node->next_same) {
+        MD_NODE *top = node;
+        while (top->parent) {
+            top = top->parent;
+        }
+        if (top != node && top == namespace_node && node_matches(node, rest)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Find heading as "pkg/heading", the first node heading names inside the
+// doc of namespace pkg, which may have slashes itself
+static MD_NODE *find_namespaced_node(MD_DOC *doc, const char *heading) {
+    if (!doc->root || doc->root->level != 0) {
+        return NULL;
+    }
+    for (MD_NODE *top = doc->root; top; top = top->next) {
+        size_t size = top->text.size;
+        if (size && strncasecmp(heading, top->text.text, size) == 0 && heading[size] == '/' && heading[size + 1]) {
+            MD_NODE *node = find_in_namespace(doc, top, heading + size + 1);
+            if (node) {
+                return node;
+            }
+        }
+    }
+    return NULL;
+}
+
+void free_workspace(void) {
+    for (size_t i = 0; i < workspace_count; i++) {
+        free_doc(&workspace[i].doc);
+    }
+    free(workspace);
+    workspace       = NULL;
+    workspace_count = 0;
+    workspace_next  = 0;
+}
+
+// Find the node of heading, either its text or a path like "build/build:c".
+// The first node in document order matching either way wins. In a
+// workspace, a path may also start with the namespace of a doc.
+MD_NODE *find_node(MD_DOC *doc, const char *heading) {
+    MD_NODE *found = index_get(&doc->index, str_view(heading));
+
+    const char *end = heading + strlen(heading);
+    while (end > heading && end[-1] == '/') {
+        end--;
+    }
+    const char *last = end;
+    while (last > heading && last[-1] != '/') {
+        last--;
+    }
+    if (last == heading && end == heading + strlen(heading)) {
+        return found;
+    }
+
+    STR_VIEW segment = {last, (size_t)(end - last)};
+    for (MD_NODE *node = index_get(&doc->index, segment); node; node = node->next_same) {
+        if (found && node->order > found->order) {
+            break;
+        }
+        if (node_matches_path(node, heading)) {
+            return node;
+        }
+    }
+    return found ? found : find_namespaced_node(doc, heading);
+}
+
+// Whether a node shows up in the tree
+static int is_branch(MD_NODE *node) {
+    return node->code_block && block_executor(node->code_block) || node->child;
+}
+
+static MD_NODE *next_branch(MD_NODE *node) {
+    while (node && !is_branch(node)) {
+        node = node->next;
+    }
+    return node;
+}
+
+// Add the branches below node to the tree. The description column is laid out
+// from the label widths collected here, so the doc is only walked once.
+void node_to_tree_with_desc(MD_NODE *node, Tree *tree) {
+    MD_NODE *current_node = next_branch(node->child);
+    while (current_node) {
+        MD_NODE *next = next_branch(current_node->next);
+        int      last = next == NULL;
+
+        STR_VIEW text        = current_node->text;
+        STR_VIEW description = current_node->description;
+        int      width       = (current_node->level - 1) * 4 + string_width_n(text.text, text.size);
+        char    *label       = tree_add(tree, last, text.text, text.size, width, description.text, description.size);
+        if (!label || tree_push(tree, last) != 0) {
+            error("Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < text.size; i++) {
+            label[i] = (char)tolower((unsigned char)label[i]);
+        }
+        node_to_tree_with_desc(current_node, tree);
+        tree_pop(tree);
+
+        current_node = next;
+    }
+}
+
+void print_node_tree(MD_NODE *root, MD_NODE *node) {
+    Tree tree;
+    tree_init(&tree);
+    if (!tree_root(&tree, root->text.text, root->text.size)) {
+        error("Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    node_to_tree_with_desc(node, &tree);
+    tree_print(&tree, stdout);
+    free_tree(&tree);
+}
+
+void print_node_tree_with_desc(MD_NODE *node) {
+    print_node_tree(node, node);
+}
+
+// Print the runnable headings below node, after prefix and a '/' if there
+// is a prefix
+void print_one(MD_NODE *node, STR_VIEW prefix) {
+    for (MD_NODE *current_node = node->child; current_node; current_node = current_node->next) {
+        if (current_node->code_block && block_executor(current_node->code_block)) {
+            if (prefix.text) {
+                str_view_print_lower(prefix, stdout);
+                putchar('/');
+            }
+            str_view_print_lower(current_node->text, stdout);
+            putchar('\n');
+            print_one(current_node, prefix);
+        } else if (current_node->child) {
+            print_one(current_node, prefix);
+        }
+    }
+}
+
+// How the code of a block reaches its executor besides {CODE}
+typedef struct CODE_INPUT {
+    int         file_fd;       // Backs {CODE_FILE}, or -1
+    char        file_path[32]; // /proc/self/fd/N naming file_fd
+    int         use_stdin;     // {CODE_STDIN} was given
+    const char *out_path;      // Substituted for {OUT}, or NULL
+    int         session;       // session_fds go to the session driver
+    int         session_fds[2];
+    const int  *output_fds;    // Stdout and stderr of the executor, or NULL
+} CODE_INPUT;
+
+// Put the code of block in a sealed memfd, or an unlinked temp file where
+// memfd_create() is not available. The fd is inherited by the executor,
+// which opens it by path.
+static int open_code_file(CODE_BLOCK *block, CODE_INPUT *input) {
+    int fd = -1;
+#ifdef MFD_ALLOW_SEALING
+    fd = memfd_create("cr-code", MFD_ALLOW_SEALING);
+#endif
+    if (fd < 0) {
+        const char *tmp_dir = getenv("TMPDIR");
+        char        tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s/cr-code-", tmp_dir && *tmp_dir ? tmp_dir : "/tmp");
+        fd = mkstemp(tmp_path);
+        if (fd < 0) {
+            return -1;
+        }
+        unlink(tmp_path);
+    }
+
+    if (write_all(fd, block->code.text, block->code.size) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return -1;
+    }
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+    input->file_fd = fd;
+    snprintf(input->file_path, sizeof(input->file_path), "%s/%d",
+             access("/proc/self/fd", X_OK) == 0 ? "/proc/self/fd" : "/dev/fd", fd);
+    return 0;
+}
+
+// Feed the code of block to the executor's stdin through fd, then close it.
+// The executor may exit without reading it all.
+static void write_code_stdin(CODE_BLOCK *block, int fd) {
+    struct sigaction ignore = {0};
+    struct sigaction saved;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+    if (write_all(fd, block->code.text, block->code.size) != 0 && errno != EPIPE) {
+        perror("write code to stdin failed");
+    }
+    sigaction(SIGPIPE, &saved, NULL);
+    close(fd);
+}
+
+// Argument templates
+//
+// The arguments of an executor are compiled once, on first use, into
+// literal segments and placeholder slots. Building an argv from a template
+// is then one allocation, for the vector and the substituted arguments,
+// and a copy per segment. Values are not scanned for placeholders again, so
+// the code keeps any it contains.
+
+enum { SLOT_TEXT, SLOT_LANG, SLOT_CODE, SLOT_CODE_FILE, SLOT_OUT, SLOT_CODE_STDIN, SLOT_COUNT };
+
+static const char *slot_names[SLOT_COUNT] = {
+    [SLOT_LANG] = "{LANG}", [SLOT_CODE] = "{CODE}", [SLOT_CODE_FILE] = "{CODE_FILE}", [SLOT_OUT] = "{OUT}",
+};
+
+typedef struct {
+    int         slot;
+    const char *text; // Literal text of SLOT_TEXT
+    size_t      size;
+} ARG_SEGMENT;
+
+typedef struct ARG_TEMPLATE ARG_TEMPLATE;
+struct ARG_TEMPLATE {
+    const char  **args; // Compiled from, and the key of the template
+    size_t        arg_count;
+    ARG_SEGMENT  *segments;
+    size_t       *ends; // One past the last segment of each argument
+    int           uses[SLOT_COUNT];
+    ARG_TEMPLATE *next;
+};
+
+static ARG_TEMPLATE *arg_templates = NULL;
+
+// Append the segments of arg to template, of which there are at most
+// strlen(arg) + 1
+static void compile_arg(ARG_TEMPLATE *template, size_t *count, const char *arg) {
+    // An argument that is just {CODE_STDIN} is dropped
+    if (strcmp(arg, "{CODE_STDIN}") == 0) {
+        template->segments[(*count)++] = (ARG_SEGMENT){SLOT_CODE_STDIN, NULL, 0};
+        template->uses[SLOT_CODE_STDIN] = 1;
+        return;
+    }
+
+    const char *literal = arg;
+    for (const char *c = arg; *c;) {
+        int slot = SLOT_TEXT;
+        for (int s = SLOT_LANG; s <= SLOT_OUT && *c == '{'; s++) {
+            if (strncmp(c, slot_names[s], strlen(slot_names[s])) == 0) {
+                slot = s;
+                break;
+            }
+        }
+        if (slot == SLOT_TEXT) {
+            c++;
+            continue;
+        }
+        if (c > literal) {
+            template->segments[(*count)++] = (ARG_SEGMENT){SLOT_TEXT, literal, (size_t)(c - literal)};
+        }
+        template->segments[(*count)++] = (ARG_SEGMENT){slot, NULL, 0};
+        template->uses[slot]             = 1;
+        c += strlen(slot_names[slot]);
+        literal = c;
+    }
+    if (*literal || literal == arg) {
+        template->segments[(*count)++] = (ARG_SEGMENT){SLOT_TEXT, literal, strlen(literal)};
+    }
+}
+
+// Template of the args of an executor, compiled the first time they are
+// asked for
+static const ARG_TEMPLATE *get_arg_template(const char **args, size_t arg_count) {
+    for (ARG_TEMPLATE *template = arg_templates; template; template = template->next) {
+        if (template->args == args && template->arg_count == arg_count) {
+            return template;
+        }
+    }
+
+    size_t max_segments = 0;
+    for (size_t i = 0; i < arg_count; i++) {
+        max_segments += strlen(args[i]) + 1;
+    }
+    ARG_TEMPLATE *template = calloc(1, sizeof(ARG_TEMPLATE));
+    if (!template) {
+        return NULL;
+    }
+    template->segments = malloc(max_segments * sizeof(ARG_SEGMENT));
+    template->ends     = malloc((arg_count ? arg_count : 1) * sizeof(size_t));
+    if (!template->segments || !template->ends) {
+        free(template->segments);
+        free(template->ends);
+        free(template);
+        return NULL;
+    }
+    template->args      = args;
+    template->arg_count = arg_count;
+
+    size_t count = 0;
+    for (size_t i = 0; i < arg_count; i++) {
+        compile_arg(template, &count, args[i]);
+        template->ends[i] = count;
+    }
+
+    template->next = arg_templates;
+    arg_templates  = template;
+    return template;
+}
+
+// Argument vector of an executor run, in one allocation
+typedef struct EXEC_ARGS {
+    char **argv;
+} EXEC_ARGS;
+
+static void free_exec_args(EXEC_ARGS *exec_args) {
+    free(exec_args->argv);
+    exec_args->argv = NULL;
+}
+
+// Build the argv of a code block: the template arguments with {LANG},
+// {CODE}, {CODE_FILE} and {OUT} substituted, followed by args. A template
+// argument that is exactly {CODE_STDIN} is dropped and sets input->use_stdin.
+static int build_exec_args(EXEC_ARGS *exec_args, const char **template_args, size_t template_count, CODE_BLOCK *block,
+                           CODE_INPUT *input, char **args, int num_args) {
+    exec_args->argv              = NULL;
+    const ARG_TEMPLATE *template = get_arg_template(template_args, template_count);
+    if (!template) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+    if (template->uses[SLOT_CODE_FILE] && input->file_fd < 0 && open_code_file(block, input) != 0) {
+        perror("Cannot create code file");
+        return -1;
+    }
+    input->use_stdin = template->uses[SLOT_CODE_STDIN];
+
+    // {OUT} is kept as is without a build
+    STR_VIEW values[SLOT_COUNT] = {
+        [SLOT_LANG]      = block->info,
+        [SLOT_CODE]      = block->code,
+        [SLOT_CODE_FILE] = str_view(input->file_path),
+        [SLOT_OUT]       = str_view(input->out_path ? input->out_path : "{OUT}"),
+    };
+
+    // Size the vector and the arguments that need a copy. An argument that
+    // is a single literal is the template argument itself.
+    size_t count = num_args > 0 ? (size_t)num_args : 0;
+    size_t bytes = 0;
+    for (size_t i = 0, start = 0; i < template_count; start = template->ends[i++]) {
+        const ARG_SEGMENT *first = &template->segments[start];
+        if (first->slot == SLOT_CODE_STDIN) {
+            continue;
+        }
+        count++;
+        if (template->ends[i] - start == 1 && first->slot == SLOT_TEXT) {
+            continue;
+        }
+        for (size_t s = start; s < template->ends[i]; s++) {
+            const ARG_SEGMENT *segment = &template->segments[s];
+            bytes += segment->slot == SLOT_TEXT ? segment->size : values[segment->slot].size;
+        }
+        bytes++;
+    }
+
+    exec_args->argv = malloc((count + 1) * sizeof(char *) + bytes);
+    if (!exec_args->argv) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+    char  *text    = (char *)(exec_args->argv + count + 1);
+    size_t arg_idx = 0;
+    for (size_t i = 0, start = 0; i < template_count; start = template->ends[i++]) {
+        const ARG_SEGMENT *first = &template->segments[start];
+        if (first->slot == SLOT_CODE_STDIN) {
+            continue;
+        }
+        if (template->ends[i] - start == 1 && first->slot == SLOT_TEXT) {
+            exec_args->argv[arg_idx++] = (char *)template_args[i];
+            continue;
+        }
+        exec_args->argv[arg_idx++] = text;
+        for (size_t s = start; s < template->ends[i]; s++) {
+            const ARG_SEGMENT *segment = &template->segments[s];
+            STR_VIEW value = segment->slot == SLOT_TEXT ? (STR_VIEW){segment->text, segment->size} : values[segment->slot];
+            if (value.size) {
+                memcpy(text, value.text, value.size);
+            }
+            text += value.size;
+        }
+        *text++ = '\0';
+    }
+
+    // Add user arguments
+    for (int i = 0; i < num_args; i++) {
+        exec_args->argv[arg_idx++] = args[i];
+    }
+
+    exec_args->argv[arg_idx] = NULL;
+    return 0;
+}
+
+// Limits
+//
+// A heading can declare "limits:" in its description, and --limits=LIST
+// gives them to every heading, as words such as
+//
+//   limits: timeout=10m cpu=60 memory=2G files=256 cgroup=/sys/fs/cgroup/ci
+//
+// The ones of a heading, of the headings above it and of the option all
+// apply, the lowest of each winning. Each block, or session of blocks,
+// is then
+//   - killed with its process group after timeout, first with SIGTERM, then
+//     with SIGKILL LIMIT_GRACE seconds later,
+//   - started with soft limits of its cpu seconds, memory (address space)
+//     and open files, which it sets for itself right before the exec,
+//   - and with cgroup, run in a child cgroup of that cgroup v2 dir, with
+//     memory as its memory.max, which is removed with what is left in it.
+// Times take an s, m or h suffix, sizes a K, M, G or T one.
+
+#define LIMIT_GRACE 5
+
+typedef struct LIMITS {
+    double    timeout; // Wall seconds, or 0
+    long      cpu;     // CPU seconds, or 0
+    long long memory;  // Bytes, or 0
+    long      files;   // Open files, or 0
+    char      cgroup[PATH_MAX];
+} LIMITS;
+
+static int has_limits(const LIMITS *limits) {
+    return limits && (limits->timeout > 0 || limits->cpu || limits->memory || limits->files || limits->cgroup[0]);
+}
+
+// Number of value, with an optional suffix of one of units scaling it by
+// the scale for it
+static int parse_limit_value(const char *value, const char *units, const double *scales, double *out) {
+    char  *end;
+    double number = strtod(value, &end);
+    if (end == value || !(number > 0 && number < 1e15)) {
+        return -1;
+    }
+    if (*end) {
+        const char *unit = *units ? strchr(units, toupper((unsigned char)*end)) : NULL;
+        if (!unit || end[1]) {
+            return -1;
+        }
+        number *= scales[unit - units];
+    }
+    *out = number;
+    return 0;
+}
+
+// Parse words like "timeout=30s" of list into limits, keeping the lower
+// of each limit already there
+static int parse_limits(STR_VIEW list, LIMITS *limits) {
+    static const double time_scales[] = {1, 60, 3600};
+    static const double size_scales[] = {1024.0, 1024.0 * 1024, 1024.0 * 1024 * 1024, 1024.0 * 1024 * 1024 * 1024};
+
+    for (STR_VIEW word = next_word(&list); word.text; word = next_word(&list)) {
+        char limit[PATH_MAX + 16];
+        snprintf(limit, sizeof(limit), "%.*s", (int)word.size, word.text);
+        char  *value  = strchr(limit, '=');
+        double number = 0;
+        int    bad    = !value || !value[1];
+        if (!bad) {
+            *value++ = '\0';
+            if (strcmp(limit, "timeout") == 0 || strcmp(limit, "cpu") == 0) {
+                bad = parse_limit_value(value, "SMH", time_scales, &number);
+            } else if (strcmp(limit, "memory") == 0) {
+                bad = parse_limit_value(value, "KMGT", size_scales, &number);
+            } else if (strcmp(limit, "files") == 0) {
+                bad = parse_limit_value(value, "", NULL, &number);
+            } else if (strcmp(limit, "cgroup") != 0) {
+                bad = 1;
+            }
+        }
+        if (bad) {
+            error("Invalid limit: %.*s\n", (int)word.size, word.text);
+            return -1;
+        }
+
+#define LIMIT_MIN(old, new) ((old) && (old) < (new) ? (old) : (new))
+        if (strcmp(limit, "timeout") == 0) {
+            limits->timeout = LIMIT_MIN(limits->timeout, number);
+        } else if (strcmp(limit, "cpu") == 0) {
+            limits->cpu = LIMIT_MIN(limits->cpu, number < 1 ? 1 : (long)number);
+        } else if (strcmp(limit, "memory") == 0) {
+            limits->memory = LIMIT_MIN(limits->memory, (long long)number);
+        } else if (strcmp(limit, "files") == 0) {
+            limits->files = LIMIT_MIN(limits->files, (long)number);
+        } else if (!limits->cgroup[0]) {
+            snprintf(limits->cgroup, sizeof(limits->cgroup), "%s", value);
+        }
+#undef LIMIT_MIN
+    }
+    return 0;
+}
+
+// Limits of the blocks of node
+static int node_limits(MD_NODE *node, LIMITS *limits) {
+    memset(limits, 0, sizeof(*limits));
+    for (; node; node = node->parent) {
+        if (node->limits.size && parse_limits(node->limits, limits) != 0) {
+            return -1;
+        }
+    }
+    return config.limits ? parse_limits(str_view(config.limits), limits) : 0;
+}
+
+static int write_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = write_all(fd, text, strlen(text));
+    close(fd);
+    return result;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Written to by the handlers of SIGCHLD, SIGALRM and the forwarded signals
+// while they are caught, so that wait_output() polling it misses none that
+// come before it starts waiting
+static int wake_pipe[2] = {-1, -1};
+
+static void wake_up(void) {
+    int     saved_errno = errno;
+    ssize_t n           = write(wake_pipe[1], "", 1);
+    (void)n;
+    errno = saved_errno;
+}
+
+static volatile sig_atomic_t alarm_fired = 0;
+
+static void record_alarm(int sig) {
+    (void)sig;
+    alarm_fired = 1;
+    wake_up();
+}
+
+// Have SIGALRM interrupt what cr waits for at deadline, and every second
+// after it in case it was in a call that is retried, or never with 0
+static void arm_alarm(double deadline) {
+    struct itimerval timer = {0};
+    if (deadline > 0) {
+        timer.it_interval.tv_sec = 1;
+        double delay = deadline - monotonic_seconds();
+        delay        = delay > 0.001 ? delay : 0.001;
+        timer.it_value.tv_sec  = (time_t)delay;
+        timer.it_value.tv_usec = (suseconds_t)((delay - (double)(time_t)delay) * 1e6);
+    }
+    alarm_fired = 0;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void catch_alarm(struct sigaction *saved) {
+    struct sigaction action = {0};
+    action.sa_handler       = record_alarm;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, saved);
+}
+
+static void release_alarm(struct sigaction *saved) {
+    arm_alarm(0);
+    sigaction(SIGALRM, saved, NULL);
+}
+
+// Signals cr forwards to the children that lead process groups of their
+// own, and so do not get the ones of the terminal or of a kill of cr's
+static const int forwarded_signals[4] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+
+static volatile sig_atomic_t pending_signal = 0;
+static int                   signals_caught = 0;
+static struct sigaction      saved_child_action;
+
+static void record_signal(int sig) {
+    pending_signal = sig;
+    wake_up();
+}
+
+static void notify_child(int sig) {
+    (void)sig;
+    wake_up();
+}
+
+// Record the forwarded signals instead of dying of them, without
+// SA_RESTART so that they interrupt waiting, and have them and SIGCHLD
+// wake up wait_output(). Returns 0 if they already were.
+static int catch_signals(struct sigaction saved[4]) {
+    if (signals_caught) {
+        return 0;
+    }
+    if (wake_pipe[0] < 0 && pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe failed");
+    }
+    struct sigaction child = {0};
+    child.sa_handler       = notify_child;
+    child.sa_flags         = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&child.sa_mask);
+    sigaction(SIGCHLD, &child, &saved_child_action);
+
+    struct sigaction forward = {0};
+    forward.sa_handler       = record_signal;
+    sigemptyset(&forward.sa_mask);
+    for (int i = 0; i < 4; i++) {
+        sigaction(forwarded_signals[i], &forward, &saved[i]);
+    }
+    signals_caught = 1;
+    return 1;
+}
+
+static void release_signals(struct sigaction saved[4]) {
+    for (int i = 0; i < 4; i++) {
+        sigaction(forwarded_signals[i], &saved[i], NULL);
+    }
+    sigaction(SIGCHLD, &saved_child_action, NULL);
+    signals_caught = 0;
+}
+
+// Let a forked child that does not exec catch the signals anew
+static void forget_signals(void) {
+    for (int i = 0; i < 4; i++) {
+        signal(forwarded_signals[i], SIG_DFL);
+    }
+    signal(SIGCHLD, SIG_DFL);
+    signals_caught = 0;
+    for (int i = 0; i < 2; i++) {
+        if (wake_pipe[i] >= 0) {
+            close(wake_pipe[i]);
+            wake_pipe[i] = -1;
+        }
+    }
+}
+
+// Output
+//
+// With --output=prefix or --output=group, cr captures the stdout and stderr
+// of the jobs of -j, and of the records of --batch, so that the ones that
+// run at the same time do not interleave:
+//   - prefix reads them from pipes while the jobs run, and writes each line
+//     after the name of its job, and with "time" after the seconds since
+//     the first job started,
+//   - group has the jobs write to unlinked files instead, which are copied
+//     out in one piece, with sendfile() where it can, as each job ends,
+//   - raw, the default, leaves them with cr's own stdout and stderr.
+// Lines go through a fixed buffer of each job, and the last OUTPUT_TAIL
+// bytes of a job are kept to be shown again at the end if it fails.
+
+enum { OUTPUT_RAW, OUTPUT_PREFIX, OUTPUT_GROUP };
+
+#define OUTPUT_LINE_MAX 16384 // Longer lines are split
+#define OUTPUT_TAIL     2048
+#define OUTPUT_IOV      256
+
+typedef struct OUTPUT_STREAM {
+    int    fd;     // Read end of the pipe with prefix, or -1
+    int    target; // STDOUT_FILENO or STDERR_FILENO
+    size_t size;   // Of the partial line in line
+    char   line[OUTPUT_LINE_MAX];
+} OUTPUT_STREAM;
+
+typedef struct OUTPUT OUTPUT;
+struct OUTPUT {
+    OUTPUT       *next;         // In the list of the outputs being captured
+    int           child_fds[2]; // Stdout and stderr of the children: pipes, or files with group
+    OUTPUT_STREAM streams[2];
+    char          prefix[128]; // The name, padded, and " | "
+    size_t        name_size;
+    size_t        prefix_size;
+    char          tail[OUTPUT_TAIL]; // Ring of the last output
+    size_t        tail_size;         // Of all the output so far
+};
+
+static OUTPUT *outputs      = NULL; // Read from by wait_output()
+static double  output_epoch = 0;
+
+// Parse --output=LIST, a mode and "time"
+static int parse_output(const char *list) {
+    STR_VIEW words = str_view(list);
+    for (STR_VIEW word = next_word(&words); word.text; word = next_word(&words)) {
+        if (str_view_casecmp(word, "raw") == 0) {
+            config.output = OUTPUT_RAW;
+        } else if (str_view_casecmp(word, "prefix") == 0) {
+            config.output = OUTPUT_PREFIX;
+        } else if (str_view_casecmp(word, "group") == 0) {
+            config.output = OUTPUT_GROUP;
+        } else if (str_view_casecmp(word, "time") == 0) {
+            config.output_time = 1;
+        } else {
+            error("Unknown output mode: %.*s\n", (int)word.size, word.text);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// An unlinked file for the output of a job, closed on exec
+static int open_spill_file(void) {
+    int fd = -1;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("cr-output", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+        const char *tmp_dir = getenv("TMPDIR");
+        char        tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s/cr-output-", tmp_dir && *tmp_dir ? tmp_dir : "/tmp");
+        fd = mkstemp(tmp_path);
+        if (fd < 0) {
+            return -1;
+        }
+        unlink(tmp_path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+static void output_tail_add(OUTPUT *output, const char *data, size_t size) {
+    if (size > OUTPUT_TAIL) {
+        output->tail_size += size - OUTPUT_TAIL;
+        data += size - OUTPUT_TAIL;
+        size = OUTPUT_TAIL;
+    }
+    while (size > 0) {
+        size_t at = output->tail_size % OUTPUT_TAIL;
+        size_t n  = size < OUTPUT_TAIL - at ? size : OUTPUT_TAIL - at;
+        memcpy(output->tail + at, data, n);
+        output->tail_size += n;
+        data += n;
+        size -= n;
+    }
+}
+
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= (ssize_t)iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Write the complete lines in the buffer of stream, each after the prefix,
+// and keep the partial line after them, unless all or it fills the buffer
+static void output_lines(OUTPUT *output, OUTPUT_STREAM *stream, int all) {
+    static char newline = '\n';
+
+    char   head[sizeof(output->prefix) + 16];
+    size_t head_size = 0;
+    if (config.output_time) {
+        int n     = snprintf(head, 16, "%8.3f ", monotonic_seconds() - output_epoch);
+        head_size = n > 0 && n < 16 ? (size_t)n : 0;
+    }
+    memcpy(head + head_size, output->prefix, output->prefix_size);
+    head_size += output->prefix_size;
+
+    struct iovec iov[OUTPUT_IOV];
+    int          count = 0;
+    char        *line  = stream->line;
+    char        *end   = stream->line + stream->size;
+    while (line < end) {
+        char *eol = memchr(line, '\n', (size_t)(end - line));
+        if (!eol && !all && (line > stream->line || stream->size < OUTPUT_LINE_MAX)) {
+            break;
+        }
+        if (count + 3 > OUTPUT_IOV) {
+            writev_all(stream->target, iov, count);
+            count = 0;
+        }
+        iov[count++] = (struct iovec){head, head_size};
+        if (eol) {
+            iov[count++] = (struct iovec){line, (size_t)(eol + 1 - line)};
+            line         = eol + 1;
+        } else {
+            iov[count++] = (struct iovec){line, (size_t)(end - line)};
+            iov[count++] = (struct iovec){&newline, 1};
+            line         = end;
+        }
+    }
+    if (count > 0) {
+        writev_all(stream->target, iov, count);
+    }
+    stream->size = (size_t)(end - line);
+    memmove(stream->line, line, stream->size);
+}
+
+// Read once from the pipe of stream, and write the lines read. Returns what
+// read() did.
+static ssize_t output_read(OUTPUT *output, OUTPUT_STREAM *stream) {
+    ssize_t n;
+    do {
+        n = read(stream->fd, stream->line + stream->size, OUTPUT_LINE_MAX - stream->size);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        output_tail_add(output, stream->line + stream->size, (size_t)n);
+        stream->size += (size_t)n;
+        output_lines(output, stream, 0);
+    }
+    return n;
+}
+
+// Start capturing the output of a job of name, padded to width columns
+static OUTPUT *output_open(const char *name, size_t name_size, int width) {
+    OUTPUT *output = calloc(1, sizeof(OUTPUT));
+    if (!output) {
+        error("Memory allocation failed\n");
+        return NULL;
+    }
+    name_size = name_size < 96 ? name_size : 96;
+    memcpy(output->prefix, name, name_size);
+    output->name_size   = name_size;
+    output->prefix_size = name_size;
+    for (int pad = width - string_width_n(name, name_size); pad > 0 && output->prefix_size < 120; pad--) {
+        output->prefix[output->prefix_size++] = ' ';
+    }
+    memcpy(output->prefix + output->prefix_size, " | ", 3);
+    output->prefix_size += 3;
+    if (!output_epoch) {
+        output_epoch = monotonic_seconds();
+    }
+
+    for (int i = 0; i < 2; i++) {
+        output->streams[i].fd     = -1;
+        output->streams[i].target = i ? STDERR_FILENO : STDOUT_FILENO;
+        output->child_fds[i]      = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        int fds[2] = {-1, -1};
+        if (config.output == OUTPUT_GROUP) {
+            fds[1] = open_spill_file();
+        } else if (pipe2(fds, O_CLOEXEC) == 0) {
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        }
+        if (fds[1] < 0) {
+            error("Cannot capture output: %s\n", strerror(errno));
+            for (int j = 0; j < i; j++) {
+                close(output->child_fds[j]);
+                if (output->streams[j].fd >= 0) {
+                    close(output->streams[j].fd);
+                }
+            }
+            free(output);
+            return NULL;
+        }
+        output->streams[i].fd = fds[0];
+        output->child_fds[i]  = fds[1];
+    }
+    output->next = outputs;
+    outputs      = output;
+    return output;
+}
+
+// Copy the output of a job in the file fd to target
+static void output_copy(OUTPUT *output, int fd, int target) {
+    off_t offset = 0;
+    off_t size   = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        return;
+    }
+    int copy = 1; // With pread(), for what sendfile() does not take
+#ifdef __linux__
+    while (offset < size) {
+        ssize_t n = sendfile(target, fd, &offset, (size_t)(size - offset));
+        if (n == 0) {
+            copy = 0;
+            break;
+        }
+        if (n < 0 && errno != EINTR) {
+            // Terminals take no sendfile()
+            copy = errno == EINVAL || errno == ENOSYS;
+            break;
+        }
+    }
+#endif
+    char buf[65536];
+    while (copy && offset < size) {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if (n <= 0 || write_all(target, buf, (size_t)n) != 0) {
+            break;
+        }
+        offset += n;
+    }
+
+    off_t  from = size > OUTPUT_TAIL ? size - OUTPUT_TAIL : 0;
+    size_t n    = (size_t)(size - from);
+    if (pread(fd, buf, n, from) == (ssize_t)n) {
+        output_tail_add(output, buf, n);
+    }
+}
+
+// Stop capturing the output of a job that is done, writing what is left of
+// it. Its tail is kept for output_report().
+static void output_close(OUTPUT *output) {
+    for (OUTPUT **link = &outputs; *link; link = &(*link)->next) {
+        if (*link == output) {
+            *link = output->next;
+            break;
+        }
+    }
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        OUTPUT_STREAM *stream = &output->streams[i];
+        if (stream->fd < 0) {
+            if (output->child_fds[i] >= 0) {
+                output_copy(output, output->child_fds[i], stream->target);
+            }
+        } else {
+            // Children the job left behind may still hold the pipe
+            if (output->child_fds[i] >= 0) {
+                close(output->child_fds[i]);
+                output->child_fds[i] = -1;
+            }
+            while (output_read(output, stream) > 0) {
+            }
+            output_lines(output, stream, 1);
+            close(stream->fd);
+            stream->fd = -1;
+        }
+        if (output->child_fds[i] >= 0) {
+            close(output->child_fds[i]);
+            output->child_fds[i] = -1;
+        }
+    }
+}
+
+static void free_output(OUTPUT *output) {
+    if (output) {
+        output_close(output);
+        free(output);
+    }
+}
+
+// Show the tail of the output of a failed job again
+static void output_report(OUTPUT *output, int exit_code) {
+    fprintf(stderr, "%s: %.*s failed with exit code %d", config.program, (int)output->name_size, output->prefix,
+            exit_code);
+    if (!output->tail_size) {
+        fputs("\n", stderr);
+        return;
+    }
+    char   tail[OUTPUT_TAIL];
+    size_t size = output->tail_size < OUTPUT_TAIL ? output->tail_size : OUTPUT_TAIL;
+    size_t at   = output->tail_size > OUTPUT_TAIL ? output->tail_size % OUTPUT_TAIL : 0;
+    memcpy(tail, output->tail + at, size - at);
+    memcpy(tail + size - at, output->tail, at);
+
+    // Start at a line when the tail is cut
+    const char *start = tail;
+    const char *eol   = memchr(tail, '\n', size);
+    if (output->tail_size > OUTPUT_TAIL && eol && eol + 1 < tail + size) {
+        start = eol + 1;
+    }
+    size -= (size_t)(start - tail);
+    fprintf(stderr, ", last output:\n%.*s%s", (int)size, start, start[size - 1] == '\n' ? "" : "\n");
+}
+
+// In a child of cr, leave the captured outputs to cr, and write stdout and
+// stderr to fds if they are not NULL
+static void output_detach(const int *fds) {
+    if (fds) {
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        config.output = OUTPUT_RAW;
+    }
+    for (OUTPUT *output = outputs; output; output = output->next) {
+        for (int i = 0; i < 2; i++) {
+            if (output->child_fds[i] >= 0) {
+                close(output->child_fds[i]);
+            }
+            if (output->streams[i].fd >= 0) {
+                close(output->streams[i].fd);
+            }
+        }
+    }
+    outputs = NULL;
+    signal(SIGCHLD, SIG_DFL);
+}
+
+// wait4() for the child pid, or any child with -1, writing the output of
+// the pipes meanwhile. As wait4(), returns -1 with EINTR on a signal, and
+// while the signals are caught, on one recorded before it was called.
+static pid_t wait_output(pid_t pid, int *status, struct rusage *usage) {
+    static struct pollfd *fds      = NULL;
+    static size_t         capacity = 0;
+    for (;;) {
+        size_t count = 1;
+        for (OUTPUT *output = outputs; output; output = output->next) {
+            count += (output->streams[0].fd >= 0) + (output->streams[1].fd >= 0);
+        }
+        if (count == 1 && (!signals_caught || wake_pipe[0] < 0)) {
+            return wait4(pid, status, 0, usage);
+        }
+        pid_t reaped = wait4(pid, status, WNOHANG, usage);
+        if (reaped != 0) {
+            return reaped;
+        }
+        // One coming after this wakes up the poll
+        if (signals_caught && (pending_signal || alarm_fired)) {
+            errno = EINTR;
+            return -1;
+        }
+
+        if (count > capacity) {
+            struct pollfd *grown = realloc(fds, count * sizeof(struct pollfd));
+            if (!grown) {
+                error("Memory allocation failed\n");
+                return wait4(pid, status, 0, usage);
+            }
+            fds      = grown;
+            capacity = count;
+        }
+        fds[0] = (struct pollfd){.fd = wake_pipe[0], .events = POLLIN};
+        count  = 1;
+        for (OUTPUT *output = outputs; output; output = output->next) {
+            for (int i = 0; i < 2; i++) {
+                if (output->streams[i].fd >= 0) {
+                    fds[count++] = (struct pollfd){.fd = output->streams[i].fd, .events = POLLIN};
+                }
+            }
+        }
+        if (poll(fds, count, -1) < 0) {
+            return -1;
+        }
+        char drained[64];
+        while (fds[0].revents && read(wake_pipe[0], drained, sizeof(drained)) > 0) {
+        }
+        count = 1;
+        for (OUTPUT *output = outputs; output; output = output->next) {
+            for (int i = 0; i < 2; i++) {
+                if (output->streams[i].fd >= 0 && fds[count++].revents) {
+                    output_read(output, &output->streams[i]);
+                }
+            }
+        }
+    }
+}
+
+// A started child of a code block
+typedef struct SPAWNED {
+    pid_t      pid;
+    TimingMark spawn;
+    TimingMark spawned;
+    double     deadline;  // Of its timeout, or 0
+    int        timed_out; // Was sent SIGTERM for it
+    int        detached;  // Leads its own process group
+    int        terminal;  // Was given the terminal, for cr to take back
+    char       cgroup[PATH_MAX]; // Its child cgroup, or ""
+} SPAWNED;
+
+// Signal spawned if it ran past its deadline, see above. Returns its next
+// deadline, or 0.
+static double enforce_deadline(SPAWNED *spawned) {
+    if (spawned->deadline <= 0 || monotonic_seconds() < spawned->deadline) {
+        return spawned->deadline;
+    }
+    if (!spawned->timed_out) {
+        error("Timed out, stopping process group %d\n", (int)spawned->pid);
+        kill(-spawned->pid, SIGTERM);
+        spawned->timed_out = 1;
+        spawned->deadline  = monotonic_seconds() + LIMIT_GRACE;
+    } else {
+        log_info("Killing process group %d\n", (int)spawned->pid);
+        kill(-spawned->pid, SIGKILL);
+        spawned->deadline = 0;
+    }
+    return spawned->deadline;
+}
+
+// Make the child cgroup of spawned under the cgroup of limits
+static int enter_cgroup(SPAWNED *spawned, const LIMITS *limits) {
+    static unsigned int count = 0;
+    int n = snprintf(spawned->cgroup, sizeof(spawned->cgroup), "%s/cr-%d-%u", limits->cgroup, (int)getpid(), count++);
+    if (n < 0 || (size_t)n >= sizeof(spawned->cgroup) || mkdir(spawned->cgroup, 0755) != 0) {
+        error("Cannot create cgroup %s: %s\n", spawned->cgroup, strerror(errno));
+        spawned->cgroup[0] = '\0';
+        return -1;
+    }
+    if (limits->memory) {
+        char path[PATH_MAX + 16];
+        char value[32];
+        snprintf(path, sizeof(path), "%s/memory.max", spawned->cgroup);
+        snprintf(value, sizeof(value), "%lld", limits->memory);
+        if (write_file(path, value) != 0) {
+            log_warn("Cannot set %s\n", path);
+        }
+    }
+    return 0;
+}
+
+// Kill what is left in the child cgroup of a reaped child, and remove it
+static void leave_cgroup(SPAWNED *spawned) {
+    if (!spawned->cgroup[0]) {
+        return;
+    }
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/cgroup.kill", spawned->cgroup);
+    write_file(path, "1");
+    for (int i = 0; i < 100 && rmdir(spawned->cgroup) != 0 && errno == EBUSY; i++) {
+        poll(NULL, 0, 10);
+    }
+    spawned->cgroup[0] = '\0';
+}
+
+// What the child is set up with before the exec
+typedef struct SPAWN_PLAN {
+    int         dups[5][2]; // An fd, and the fd to dup it to
+    int         dup_count;
+    int         null_stdin; // Stdin is /dev/null
+    int         detach;     // The child leads a new process group
+    const char *cgroup;     // The cgroup.procs the child moves itself to, or NULL
+} SPAWN_PLAN;
+
+static void plan_dup(SPAWN_PLAN *plan, int fd, int to) {
+    plan->dups[plan->dup_count][0]   = fd;
+    plan->dups[plan->dup_count++][1] = to;
+}
+
+// Set the soft limits of the child to limits, as far as its hard limits go
+static void apply_rlimits(const LIMITS *limits) {
+    const int       resources[3] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE};
+    const long long values[3]    = {limits->cpu, limits->memory, limits->files};
+    for (int i = 0; i < 3; i++) {
+        struct rlimit limit;
+        if (values[i] && getrlimit(resources[i], &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || (rlim_t)values[i] < limit.rlim_max
+                                 ? (rlim_t)values[i]
+                                 : limit.rlim_max;
+            setrlimit(resources[i], &limit);
+        }
+    }
+}
+
+// Start argv as posix_spawnp() does with plan, in a fork that first moves
+// itself into the cgroup of plan, so that none of what it runs escapes it,
+// and applies the rlimits of limits to itself after its fds are set up,
+// right before the exec. Returns 0 or the errno of a failure, as
+// posix_spawnp() does, with *stage the step that failed.
+static int spawn_limited(pid_t *pid, char **argv, const SPAWN_PLAN *plan, const LIMITS *limits, const char **stage) {
+    // Closed by the exec, or written the step and errno of what failed
+    int report[2];
+    *stage = "execute";
+    if (pipe2(report, O_CLOEXEC) != 0) {
+        return errno;
+    }
+    *pid = fork();
+    if (*pid < 0) {
+        int fork_error = errno;
+        close(report[0]);
+        close(report[1]);
+        return fork_error;
+    }
+    if (*pid == 0) {
+        close(report[0]);
+        int failure[2] = {0, 0};
+        if (plan->cgroup && write_file(plan->cgroup, "0") != 0) {
+            failure[0] = 1;
+            failure[1] = errno;
+            ssize_t n  = write(report[1], failure, sizeof(failure));
+            (void)n;
+            _exit(127);
+        }
+        if (plan->detach) {
+            setpgid(0, 0);
+        }
+        for (int i = 0; i < plan->dup_count; i++) {
+            if (plan->dups[i][0] == plan->dups[i][1]) {
+                fcntl(plan->dups[i][1], F_SETFD, 0);
+            } else {
+                dup2(plan->dups[i][0], plan->dups[i][1]);
+            }
+        }
+        if (plan->null_stdin) {
+            int null_fd = open("/dev/null", O_RDONLY);
+            if (null_fd > STDIN_FILENO) {
+                dup2(null_fd, STDIN_FILENO);
+                close(null_fd);
+            }
+        }
+        apply_rlimits(limits);
+        execvp(argv[0], argv);
+        failure[1] = errno;
+        ssize_t n  = write(report[1], failure, sizeof(failure));
+        (void)n;
+        _exit(127);
+    }
+
+    close(report[1]);
+    int     failure[2] = {0, 0};
+    ssize_t n;
+    while ((n = read(report[0], failure, sizeof(failure))) < 0 && errno == EINTR) {
+    }
+    close(report[0]);
+    if (n == (ssize_t)sizeof(failure)) {
+        waitpid(*pid, NULL, 0);
+        *stage = failure[0] ? "enter cgroup for" : "execute";
+        return failure[1];
+    }
+    return 0;
+}
+
+// Make the process group of spawned the foreground one of the terminal cr
+// is in the foreground of, as a shell does, so that it reads the terminal
+// and gets its signals
+static void give_terminal(SPAWNED *spawned) {
+    if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != getpgrp()) {
+        return;
+    }
+    struct sigaction ignore = {0};
+    struct sigaction saved;
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGTTOU, &ignore, &saved);
+    spawned->terminal = tcsetpgrp(STDIN_FILENO, spawned->pid) == 0;
+    sigaction(SIGTTOU, &saved, NULL);
+    // It may have been stopped reading before it was given the terminal
+    kill(-spawned->pid, SIGCONT);
+}
+
+static void take_terminal(SPAWNED *spawned) {
+    if (!spawned->terminal) {
+        return;
+    }
+    struct sigaction ignore = {0};
+    struct sigaction saved;
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGTTOU, &ignore, &saved);
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    sigaction(SIGTTOU, &saved, NULL);
+    spawned->terminal = 0;
+}
+
+// Start the template arguments of block followed by args, under limits if
+// not NULL. With detach the child leads a new process group, so that it can
+// be signalled with its own children, and has no terminal stdin. A child
+// with a timeout leads one too, but is given the terminal. Returns 0, 127
+// if the child could not be started, or 1 on other errors.
+static int spawn_block(CODE_BLOCK *block, const char **template_args, size_t template_count, CODE_INPUT *input,
+                       char **args, int num_args, int detach, const LIMITS *limits, SPAWNED *spawned) {
+    extern char **environ;
+
+    spawned->deadline  = 0;
+    spawned->timed_out = 0;
+    spawned->detached  = detach || (limits && limits->timeout > 0);
+    spawned->terminal  = 0;
+    spawned->cgroup[0] = '\0';
+
+    EXEC_ARGS exec_args;
+    if (build_exec_args(&exec_args, template_args, template_count, block, input, args, num_args) != 0) {
+        return 1;
+    }
+    if (limits && limits->cgroup[0] && enter_cgroup(spawned, limits) != 0) {
+        free_exec_args(&exec_args);
+        return 1;
+    }
+
+    // The write end of the stdin pipe stays with us
+    int        stdin_pipe[2] = {-1, -1};
+    SPAWN_PLAN plan          = {.detach = spawned->detached};
+    if (input->use_stdin) {
+        if (pipe2(stdin_pipe, O_CLOEXEC) != 0) {
+            perror("pipe failed");
+            leave_cgroup(spawned);
+            free_exec_args(&exec_args);
+            return 1;
+        }
+        plan_dup(&plan, stdin_pipe[0], STDIN_FILENO);
+    } else if (detach && isatty(STDIN_FILENO)) {
+        // A background process group would be stopped reading the terminal
+        plan.null_stdin = 1;
+    }
+    if (input->session) {
+        plan_dup(&plan, input->session_fds[0], SESSION_CODE_FD);
+        plan_dup(&plan, input->session_fds[1], SESSION_STATUS_FD);
+    }
+    if (input->output_fds) {
+        plan_dup(&plan, input->output_fds[0], STDOUT_FILENO);
+        plan_dup(&plan, input->output_fds[1], STDERR_FILENO);
+    }
+
+    // Spawn without copying our address space, unless the child has to set
+    // up its limits. Pending output is flushed first so it stays in order with
+    // the child's.
+    fflush(stdout);
+    log_flush();
+    char        cgroup_procs[PATH_MAX + 16];
+    const char *stage = "execute";
+    int         spawn_error;
+    if (spawned->cgroup[0]) {
+        snprintf(cgroup_procs, sizeof(cgroup_procs), "%s/cgroup.procs", spawned->cgroup);
+        plan.cgroup = cgroup_procs;
+    }
+    timing_start(&spawned->spawn);
+    if (plan.cgroup || (limits && (limits->cpu || limits->memory || limits->files))) {
+        spawn_error = spawn_limited(&spawned->pid, exec_args.argv, &plan, limits, &stage);
+    } else {
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t          attr;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        for (int i = 0; i < plan.dup_count; i++) {
+            posix_spawn_file_actions_adddup2(&actions, plan.dups[i][0], plan.dups[i][1]);
+        }
+        if (plan.null_stdin) {
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        }
+        if (plan.detach) {
+            posix_spawnattr_setpgroup(&attr, 0);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        }
+        spawn_error = posix_spawnp(&spawned->pid, exec_args.argv[0], &actions, &attr, exec_args.argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+    }
+    timing_start(&spawned->spawned);
+    if (input->use_stdin) {
+        close(stdin_pipe[0]);
+    }
+    if (spawn_error != 0) {
+        error("Cannot %s %s: %s\n", stage, exec_args.argv[0], strerror(spawn_error));
+        leave_cgroup(spawned);
+        free_exec_args(&exec_args);
+        if (input->use_stdin) {
+            close(stdin_pipe[1]);
+        }
+        return 127;
+    }
+    free_exec_args(&exec_args);
+    if (limits && limits->timeout > 0) {
+        spawned->deadline = monotonic_seconds() + limits->timeout;
+    }
+    if (spawned->detached && !detach) {
+        give_terminal(spawned);
+    }
+    if (input->use_stdin) {
+        write_code_stdin(block, stdin_pipe[1]);
+    }
+    return 0;
+}
+
+// Exit code of a reaped child of block: its exit status, or 128 + the
+// signal number if it was killed
+static int block_status(MD_NODE *node, CODE_BLOCK *block, const char *phase, SPAWNED *spawned, int status,
+                        struct rusage *usage) {
+    if (timing_enabled()) {
+        char name[256];
+        snprintf(name, sizeof(name), "%s: %.*s (%.*s)", phase, (int)node->text.size, node->text.text,
+                 (int)block->info.size, block->info.text);
+        timing_child(name, &spawned->spawn, &spawned->spawned, usage, status);
+    }
+    log_info("Command rusage: user %ld.%06lds, sys %ld.%06lds, max rss %ld KB\n", (long)usage->ru_utime.tv_sec,
+             (long)usage->ru_utime.tv_usec, (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec,
+             usage->ru_maxrss);
+    leave_cgroup(spawned);
+
+    if (WIFSIGNALED(status)) {
+        // Report like a shell does
+        log_info("Command killed by signal %d\n", WTERMSIG(status));
+        return 128 + WTERMSIG(status);
+    }
+    log_info("Command exit code: %d\n", WEXITSTATUS(status));
+    return WEXITSTATUS(status);
+}
+
+// Wait for spawned, enforcing its deadline, and forwarding signals to it
+// when it leads its own process group
+static int wait_spawned(SPAWNED *spawned, int *status, struct rusage *usage) {
+    struct sigaction saved;
+    struct sigaction saved_signals[4];
+    int              timed  = spawned->deadline > 0;
+    int              caught = spawned->detached && catch_signals(saved_signals);
+    int              result = 0;
+    if (timed) {
+        catch_alarm(&saved);
+    }
+    for (;;) {
+        if (pending_signal && signals_caught) {
+            log_info("Forwarding signal %d to process %d\n", (int)pending_signal, (int)spawned->pid);
+            kill(spawned->detached ? -spawned->pid : spawned->pid, pending_signal);
+            pending_signal = 0;
+        }
+        if (timed) {
+            arm_alarm(enforce_deadline(spawned));
+        }
+        if (wait_output(spawned->pid, status, usage) != -1) {
+            break;
+        }
+        if (errno != EINTR) {
+            perror("wait4 failed");
+            result = -1;
+            break;
+        }
+    }
+    if (timed) {
+        release_alarm(&saved);
+    }
+    if (caught) {
+        release_signals(saved_signals);
+    }
+    take_terminal(spawned);
+    return result;
+}
+
+// Run the template arguments of block followed by args, under limits if
+// not NULL, and wait for it. Returns its exit code, as for block_status(),
+// or as for spawn_block() if it could not be started.
+static int run_block(MD_NODE *node, CODE_BLOCK *block, const char *phase, const char **template_args,
+                     size_t template_count, CODE_INPUT *input, char **args, int num_args, const LIMITS *limits) {
+    SPAWNED spawned;
+    int exit_code = spawn_block(block, template_args, template_count, input, args, num_args, 0, limits, &spawned);
+    if (exit_code != 0) {
+        return exit_code;
+    }
+
+    int           status;
+    struct rusage usage;
+    if (wait_spawned(&spawned, &status, &usage) != 0) {
+        leave_cgroup(&spawned);
+        return 1;
+    }
+    return block_status(node, block, phase, &spawned, status, &usage);
+}
+
+// A pipe with both ends close-on-exec and above the fds of the session
+// drivers, so that spawning can dup them there
+static int session_pipe(int fds[2]) {
+    int raw[2];
+    if (pipe2(raw, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fds[i] = fcntl(raw[i], F_DUPFD_CLOEXEC, SESSION_STATUS_FD + 1);
+        close(raw[i]);
+    }
+    if (fds[0] < 0 || fds[1] < 0) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Send the code of block to a session driver, ending it with a newline
+static int session_send(int fd, CODE_BLOCK *block) {
+    STR_VIEW code    = block->code;
+    int      newline = code.size && code.text[code.size - 1] != '\n';
+    size_t   lines   = (size_t)newline;
+    for (const char *p = code.text; (p = memchr(p, '\n', (size_t)(code.text + code.size - p))); p++) {
+        lines++;
+    }
+    char header[48];
+    int  header_size = snprintf(header, sizeof(header), "%zu %zu\n", code.size + (size_t)newline, lines);
+    return write_all(fd, header, (size_t)header_size) != 0 || write_all(fd, code.text, code.size) != 0 ||
+                   (newline && write_all(fd, "\n", 1) != 0)
+               ? -1
+               : 0;
+}
+
+// With --session, run the blocks from first to last, which have the same
+// executor, in one interpreter started with its session arguments, to pay
+// its startup once. *stopped is set to the block that was running when the
+// interpreter exited. Returns the exit code of the interpreter, which is
+// the one of the block that failed, if any.
+static int run_session(MD_NODE *node, CODE_BLOCK *first, CODE_BLOCK *last, const struct Executor *executor,
+                       char **args, int num_args, const LIMITS *limits, CODE_BLOCK **stopped) {
+    int code_pipe[2];
+    int status_pipe[2];
+    if (session_pipe(code_pipe) != 0) {
+        perror("pipe failed");
+        return 1;
+    }
+    if (session_pipe(status_pipe) != 0) {
+        perror("pipe failed");
+        close(code_pipe[0]);
+        close(code_pipe[1]);
+        return 1;
+    }
+    log_info("Starting session: %s\n", executor->lang);
+
+    CODE_INPUT input = {.file_fd = -1, .session = 1, .session_fds = {code_pipe[0], status_pipe[1]}};
+    SPAWNED    spawned;
+    int        exit_code = spawn_block(first, executor->session_args, executor->session_args_count, &input, args,
+                                       num_args, 0, limits, &spawned);
+    close(code_pipe[0]);
+    close(status_pipe[1]);
+    if (exit_code != 0) {
+        close(code_pipe[1]);
+        close(status_pipe[0]);
+        return exit_code;
+    }
+
+    // A driver that is gone shows as a failed write, or as the end of its
+    // status. One past its deadline is interrupted waiting for that.
+    // A signal to forward is forwarded by wait_spawned().
+    struct sigaction ignore = {0};
+    struct sigaction saved;
+    struct sigaction saved_alarm;
+    struct sigaction saved_signals[4];
+    int              timed  = spawned.deadline > 0;
+    int              caught = spawned.detached && catch_signals(saved_signals);
+    ignore.sa_handler       = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &saved);
+    if (timed) {
+        catch_alarm(&saved_alarm);
+        arm_alarm(spawned.deadline);
+    }
+    FILE *status_file = fdopen(status_pipe[0], "r");
+    char  line[16];
+    *stopped = first;
+    while (status_file && session_send(code_pipe[1], *stopped) == 0 && fgets(line, sizeof(line), status_file) &&
+           strcmp(line, "0\n") == 0 && *stopped != last) {
+        *stopped = (*stopped)->next;
+    }
+    close(code_pipe[1]);
+    if (status_file) {
+        fclose(status_file);
+    } else {
+        close(status_pipe[0]);
+    }
+
+    int           status;
+    struct rusage usage;
+    int           waited = wait_spawned(&spawned, &status, &usage);
+    if (timed) {
+        release_alarm(&saved_alarm);
+    }
+    if (caught) {
+        release_signals(saved_signals);
+    }
+    sigaction(SIGPIPE, &saved, NULL);
+    if (waited != 0) {
+        leave_cgroup(&spawned);
+        return 1;
+    }
+    return block_status(node, first, "session", &spawned, status, &usage);
+}
+
+// Replace cr with the template arguments of block followed by args. The doc
+// and the log are released first, as nothing is left to do afterwards.
+// Returns -1 if the block has to be run as a child instead, or 127 if the
+// exec failed.
+static int exec_in_place(CODE_BLOCK *block, const char **template_args, size_t template_count, CODE_INPUT *input,
+                         char **args, int num_args) {
+    EXEC_ARGS exec_args;
+    if (build_exec_args(&exec_args, template_args, template_count, block, input, args, num_args) != 0) {
+        return -1;
+    }
+
+    // Nothing would be left to write the stdin pipe, so the code file
+    // stands in for it
+    if (input->use_stdin) {
+        if ((input->file_fd < 0 && open_code_file(block, input) != 0) || dup2(input->file_fd, STDIN_FILENO) < 0) {
+            free_exec_args(&exec_args);
+            return -1;
+        }
+    }
+
+    log_info("Executing in place: %s\n", exec_args.argv[0]);
+    fflush(stdout);
+    fflush(stderr);
+    log_close();
+    free_doc(&doc);
+    execvp(exec_args.argv[0], exec_args.argv);
+
+    error("Cannot execute %s: %s\n", exec_args.argv[0], strerror(errno));
+    free_exec_args(&exec_args);
+    return 127;
+}
+
+// Build cache
+//
+// Binaries of executors with build arguments are kept in the cache dir,
+// named by a hash of the build arguments, the program they run and the code,
+// so that an upgraded compiler builds them again. Concurrent builds are
+// serialized by a lock on the dir and published by renaming.
+
+// FNV-1a over size bytes, continuing from hash
+static uint64_t fnv1a_64_update(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Path of the program command runs, looked up in PATH as by execvp()
+static int find_program(const char *command, char *buf, size_t size) {
+    if (strchr(command, '/')) {
+        int n = snprintf(buf, size, "%s", command);
+        return n >= 0 && (size_t)n < size && access(buf, X_OK) == 0 ? 0 : -1;
+    }
+    const char *path = getenv("PATH");
+    path             = path ? path : "/usr/bin:/bin";
+    for (const char *start = path;; start++) {
+        const char *end = strchr(start, ':');
+        size_t      len = end ? (size_t)(end - start) : strlen(start);
+        int         n   = len ? snprintf(buf, size, "%.*s/%s", (int)len, start, command)
+                              : snprintf(buf, size, "./%s", command);
+        if (n >= 0 && (size_t)n < size && access(buf, X_OK) == 0) {
+            return 0;
+        }
+        if (!end) {
+            return -1;
+        }
+        start = end;
+    }
+}
+
+// Two FNV-1a hashes with different offset bases over the build arguments,
+// the path, size and mtime of the program they run, and the code, so that a
+// collision of both is very unlikely
+static void build_hash(const struct Executor *executor, CODE_BLOCK *block, char *buf, size_t size) {
+    char            program[PATH_MAX] = "";
+    struct stat     st                = {0};
+    struct timespec mtime             = {0, 0};
+    if (executor->build_args_count && find_program(executor->build_args[0], program, sizeof(program)) == 0 &&
+        stat(program, &st) == 0) {
+        mtime = stat_mtime(&st);
+    }
+    uint64_t hashes[2] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    for (int h = 0; h < 2; h++) {
+        for (size_t i = 0; i < executor->build_args_count; i++) {
+            hashes[h] = fnv1a_64_update(hashes[h], executor->build_args[i], strlen(executor->build_args[i]) + 1);
+        }
+        hashes[h] = fnv1a_64_update(hashes[h], program, strlen(program) + 1);
+        hashes[h] = fnv1a_64_update(hashes[h], &st.st_size, sizeof(st.st_size));
+        hashes[h] = fnv1a_64_update(hashes[h], &mtime, sizeof(mtime));
+        hashes[h] = fnv1a_64_update(hashes[h], block->code.text, block->code.size);
+    }
+    snprintf(buf, size, "%016llx%016llx", (unsigned long long)hashes[0], (unsigned long long)hashes[1]);
+}
+
+// Build into a private temp dir, for when there is no cache
+static int build_temporary(MD_NODE *node, CODE_BLOCK *block, const struct Executor *executor, CODE_INPUT *input,
+                           char *out_path, size_t size, int *temporary) {
+    const char *tmp_dir = getenv("TMPDIR");
+    char        dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/cr-build-XXXXXX", tmp_dir && *tmp_dir ? tmp_dir : "/tmp");
+    if (!mkdtemp(dir)) {
+        perror("Cannot create build dir");
+        return 1;
+    }
+    int n = snprintf(out_path, size, "%s/a.out", dir);
+    if (n < 0 || (size_t)n >= size) {
+        error("Build path too long: %s\n", dir);
+        rmdir(dir);
+        return 1;
+    }
+    *temporary      = 1;
+    input->out_path = out_path;
+    return run_block(node, block, "build", executor->build_args, executor->build_args_count, input, NULL, 0, NULL);
+}
+
+// Remove a binary from build_temporary() and its dir
+static void remove_build(char *out_path) {
+    unlink(out_path);
+    char *slash = strrchr(out_path, '/');
+    if (slash) {
+        *slash = '\0';
+        rmdir(out_path);
+    }
+}
+
+// Make sure block is built with the build arguments of executor, and set
+// out_path to the binary. *temporary tells whether it is to be removed with
+// remove_build() after the run. Returns the exit code of the build.
+static int build_block(MD_NODE *node, CODE_BLOCK *block, const struct Executor *executor, CODE_INPUT *input,
+                       char *out_path, size_t size, int *temporary) {
+    char dir[PATH_MAX];
+    if (config.no_cache || get_cache_dir(dir, sizeof(dir)) != 0 || strlen(dir) + 5 >= sizeof(dir)) {
+        return build_temporary(node, block, executor, input, out_path, size, temporary);
+    }
+    strcat(dir, "/bin");
+    if (mkdir_p(dir) != 0) {
+        return build_temporary(node, block, executor, input, out_path, size, temporary);
+    }
+
+    char hash[33];
+    build_hash(executor, block, hash, sizeof(hash));
+    snprintf(out_path, size, "%s/%s", dir, hash);
+    if (access(out_path, X_OK) == 0) {
+        log_info("Using cached build: %s\n", out_path);
+        return 0;
+    }
+
+    int lock_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (lock_fd < 0) {
+        perror("Cannot open build lock");
+        return 1;
+    }
+    while (flock(lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            perror("Cannot lock build");
+            close(lock_fd);
+            return 1;
+        }
+    }
+
+    // Another run may have built it while we waited
+    int exit_code = 0;
+    if (access(out_path, X_OK) == 0) {
+        log_info("Using cached build: %s\n", out_path);
+    } else {
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", out_path, (long)getpid());
+        input->out_path = tmp_path;
+        exit_code       = run_block(node, block, "build", executor->build_args, executor->build_args_count, input,
+                                    NULL, 0, NULL);
+        input->out_path = NULL;
+        if (exit_code == 0 && rename(tmp_path, out_path) != 0) {
+            perror("Cannot store build");
+            exit_code = 1;
+        }
+        if (exit_code != 0) {
+            unlink(tmp_path);
+        } else {
+            log_info("Saved build: %s\n", out_path);
+        }
+    }
+    close(lock_fd);
+    return exit_code;
+}
+
+// Execute code blocks for a given node
+int exec_node(MD_NODE *node, char **args, int num_args) {
+    int exit_code = 0;
+    if (!node->code_block) {
+        log_info("no code blocks under this heading\n");
+        fprintf(stderr, "no code blocks under this heading\n");
+        return EXIT_FAILURE;
+    }
+    log_info("Executing node: %.*s\n", (int)node->text.size, node->text.text);
+    LIMITS limits;
+    if (node_limits(node, &limits) != 0) {
+        return 1;
+    }
+
+    CODE_BLOCK *block = node->code_block;
+    while (block) {
+        if (block->info.text && block->code.text) {
+            STR_VIEW               lang     = block->info;
+            const struct Executor *executor = block_executor(block);
+
+            if (executor) {
+                log_debug("Executing code block: \n```%.*s\n%.*s```\n", (int)block->info.size, block->info.text,
+                           (int)block->code.size, block->code.text);
+                log_info("Using language profile: %s\n", executor->lang);
+
+                // With --session, the blocks after it with the same executor
+                // run in its interpreter
+                CODE_BLOCK *last = block;
+                while (config.session && executor->session_args && last->next && last->next->info.text &&
+                       last->next->code.text && block_executor(last->next) == executor) {
+                    last = last->next;
+                }
+                if (last != block) {
+                    CODE_BLOCK *stopped;
+                    exit_code = run_session(node, block, last, executor, args, num_args, &limits, &stopped);
+                    if (exit_code) {
+                        break;
+                    }
+                    block = stopped->next;
+                    continue;
+                }
+
+                char       out_path[PATH_MAX];
+                int        temporary = 0;
+                CODE_INPUT input     = {.file_fd = -1};
+                if (executor->build_args_count > 0) {
+                    exit_code = build_block(node, block, executor, &input, out_path, sizeof(out_path), &temporary);
+                    input.out_path = out_path;
+                }
+                // The only block of the heading takes over the process,
+                // unless its timing, its temporary build or its limits
+                // still need cr
+                if (exit_code == 0 && block == node->code_block && !block->next && !temporary && !timing_enabled() &&
+                    !has_limits(&limits)) {
+                    exit_code = exec_in_place(block, executor->prefix_args, executor->prefix_args_count, &input, args,
+                                              num_args);
+                    if (exit_code >= 0) {
+                        return exit_code;
+                    }
+                    exit_code = 0;
+                }
+                if (exit_code == 0) {
+                    exit_code = run_block(node, block, "exec", executor->prefix_args, executor->prefix_args_count,
+                                          &input, args, num_args, &limits);
+                }
+                if (input.file_fd >= 0) {
+                    close(input.file_fd);
+                }
+                if (temporary) {
+                    remove_build(out_path);
+                }
+            } else {
+                error("%s: Unsupported language: %.*s\n", config.program, (int)lang.size, lang.text);
+                return 1;
+            }
+        }
+        if (exit_code) {
+            break;
+        }
+        block = block->next;
+    }
+    return exit_code;
+}
+
+// Jobs
+//
+// With -j, the code blocks of a heading, or its child headings when it has
+// none, are jobs run on a bounded pool of children. The blocks of a child
+// heading still run in order. Each child leads its own process group, and
+// signals received meanwhile are forwarded to all of them.
+//
+// Headings can also declare "deps:", "inputs:" and "outputs:" lines in
+// their description. The deps become jobs of their own that have to succeed
+// first, and a heading whose outputs are newer than its inputs, whose code
+// is unchanged since it last succeeded and whose deps did not run is
+// skipped.
+
+enum { JOB_WAITING, JOB_RUNNING, JOB_DONE };
+
+typedef struct JOB {
+    MD_NODE    *node;
+    CODE_BLOCK *block; // Running, or next to run
+    CODE_BLOCK *end;   // Block after the last one of the job
+    int         whole; // Runs all the blocks of node, rather than one
+    int         root;  // Run for the command line, and given its args
+    size_t     *deps;  // Indices of the jobs to run first
+    size_t      dep_count;
+    int         state;
+    int         exit_code;
+    int         ran;     // Had to run, rather than being up to date
+    int         on_path; // Its deps are being added, to detect cycles
+    CODE_INPUT  input;
+    char        out_path[PATH_MAX];
+    int         temporary;
+    SPAWNED     spawned;
+    OUTPUT     *output; // Captured with --output, see Output
+} JOB;
+
+typedef struct JOB_LIST {
+    JOB   *jobs;
+    size_t count;
+    size_t capacity;
+    int    name_width; // Of the widest job name when capturing the output, or -1
+} JOB_LIST;
+
+static int has_directives(MD_NODE *node) {
+    return node->deps.size || node->inputs.size || node->outputs.size;
+}
+
+static void free_jobs(JOB_LIST *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->jobs[i].deps);
+        free_output(list->jobs[i].output);
+    }
+    free(list->jobs);
+}
+
+static ssize_t add_job(JOB_LIST *list, JOB job) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        JOB   *jobs     = realloc(list->jobs, capacity * sizeof(JOB));
+        if (!jobs) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        list->jobs     = jobs;
+        list->capacity = capacity;
+    }
+    job.input                  = (CODE_INPUT){.file_fd = -1};
+    list->jobs[list->count++] = job;
+    return (ssize_t)(list->count - 1);
+}
+
+// Add the jobs of the deps of job index, and theirs
+static int add_dep_jobs(JOB_LIST *list, size_t index) {
+    STR_VIEW deps = list->jobs[index].node->deps;
+    for (STR_VIEW word = next_word(&deps); word.text; word = next_word(&deps)) {
+        char *name = strndup(word.text, word.size);
+        if (!name) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        MD_NODE *dep = find_node(&doc, name);
+        if (!dep) {
+            error("Cannot find dependency %s of %.*s\n", name, (int)list->jobs[index].node->text.size,
+                  list->jobs[index].node->text.text);
+            free(name);
+            return -1;
+        }
+        free(name);
+
+        ssize_t dep_index = -1;
+        for (size_t i = 0; i < list->count; i++) {
+            if (list->jobs[i].node == dep && list->jobs[i].whole) {
+                dep_index = (ssize_t)i;
+                break;
+            }
+        }
+        if (dep_index >= 0 && list->jobs[dep_index].on_path) {
+            error("Dependency cycle through %.*s\n", (int)dep->text.size, dep->text.text);
+            return -1;
+        }
+
+        size_t *deps_array = realloc(list->jobs[index].deps, (list->jobs[index].dep_count + 1) * sizeof(size_t));
+        if (!deps_array) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        list->jobs[index].deps = deps_array;
+
+        if (dep_index < 0) {
+            dep_index = add_job(list, (JOB){.node = dep, .block = dep->code_block, .whole = 1});
+            if (dep_index < 0) {
+                return -1;
+            }
+            list->jobs[dep_index].on_path = 1;
+            int result                    = add_dep_jobs(list, (size_t)dep_index);
+            list->jobs[dep_index].on_path = 0;
+            if (result != 0) {
+                return -1;
+            }
+        }
+        list->jobs[index].deps[list->jobs[index].dep_count++] = (size_t)dep_index;
+    }
+    return 0;
+}
+
+// Jobs for running node, see above
+static int collect_jobs(MD_NODE *node, int split, JOB_LIST *list) {
+    if (split && node->code_block && !has_directives(node)) {
+        for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+            if (add_job(list, (JOB){.node = node, .block = block, .end = block->next, .root = 1}) < 0) {
+                return -1;
+            }
+        }
+    } else if (split && !node->code_block && !has_directives(node)) {
+        for (MD_NODE *child = node->child; child; child = child->next) {
+            if ((child->code_block || has_directives(child)) &&
+                add_job(list, (JOB){.node = child, .block = child->code_block, .whole = 1, .root = 1}) < 0) {
+                return -1;
+            }
+        }
+    } else if (add_job(list, (JOB){.node = node, .block = node->code_block, .whole = 1, .root = 1}) < 0) {
+        return -1;
+    }
+
+    size_t roots = list->count;
+    for (size_t i = 0; i < roots; i++) {
+        list->jobs[i].on_path = 1;
+        int result            = add_dep_jobs(list, i);
+        list->jobs[i].on_path = 0;
+        if (result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Path of the file holding the code hash node had when it last succeeded
+static int job_state_path(MD_NODE *node, char *buf, size_t size) {
+    char           dir[PATH_MAX];
+    char           doc_path[PATH_MAX];
+    WORKSPACE_DOC *owner = workspace_doc(node);
+    if (get_cache_dir(dir, sizeof(dir)) != 0 || !realpath(owner ? owner->path : config.file_path, doc_path) ||
+        strlen(dir) + 7 >= sizeof(dir)) {
+        return -1;
+    }
+    strcat(dir, "/state");
+    if (mkdir_p(dir) != 0) {
+        return -1;
+    }
+
+    // Keyed by the doc and the heading path, which survive edits elsewhere
+    uint64_t hash = fnv1a_64_update(0xcbf29ce484222325ULL, doc_path, strlen(doc_path) + 1);
+    for (MD_NODE *current = node; current; current = current->parent) {
+        hash = fnv1a_64_update(hash, current->text.text, current->text.size);
+        hash = fnv1a_64_update(hash, "/", 1);
+    }
+    int n = snprintf(buf, size, "%s/%016llx", dir, (unsigned long long)hash);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// Hash of the code blocks of node, as hex
+static void node_code_hash(MD_NODE *node, char *buf, size_t size) {
+    uint64_t hashes[2] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL};
+    for (int h = 0; h < 2; h++) {
+        for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+            hashes[h] = fnv1a_64_update(hashes[h], block->info.text, block->info.size);
+            hashes[h] = fnv1a_64_update(hashes[h], "\n", 1);
+            hashes[h] = fnv1a_64_update(hashes[h], block->code.text, block->code.size);
+        }
+    }
+    snprintf(buf, size, "%016llx%016llx", (unsigned long long)hashes[0], (unsigned long long)hashes[1]);
+}
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+// Whether the outputs of job are up to date, see above
+static int job_up_to_date(JOB_LIST *list, JOB *job) {
+    MD_NODE *node = job->node;
+    if (!job->whole || !node->outputs.size) {
+        return 0;
+    }
+    for (size_t i = 0; i < job->dep_count; i++) {
+        if (list->jobs[job->deps[i]].ran) {
+            return 0;
+        }
+    }
+
+    // The oldest output has to be newer than the newest input
+    struct timespec oldest_output = {0, 0};
+    int             have_output   = 0;
+    STR_VIEW        outputs       = node->outputs;
+    for (STR_VIEW word = next_word(&outputs); word.text; word = next_word(&outputs)) {
+        char        path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%.*s", (int)word.size, word.text);
+        if (stat(path, &st) != 0) {
+            log_info("Missing output: %s\n", path);
+            return 0;
+        }
+        struct timespec mtime = stat_mtime(&st);
+        if (!have_output || timespec_cmp(&mtime, &oldest_output) < 0) {
+            oldest_output = mtime;
+            have_output   = 1;
+        }
+    }
+
+    STR_VIEW inputs = node->inputs;
+    for (STR_VIEW word = next_word(&inputs); word.text; word = next_word(&inputs)) {
+        char   pattern[PATH_MAX];
+        glob_t matches;
+        snprintf(pattern, sizeof(pattern), "%.*s", (int)word.size, word.text);
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            log_info("Missing input: %s\n", pattern);
+            return 0;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            struct stat     st;
+            int             found = stat(matches.gl_pathv[i], &st) == 0;
+            struct timespec mtime = found ? stat_mtime(&st) : oldest_output;
+            if (!found || timespec_cmp(&mtime, &oldest_output) > 0) {
+                log_info("Newer input: %s\n", matches.gl_pathv[i]);
+                globfree(&matches);
+                return 0;
+            }
+        }
+        globfree(&matches);
+    }
+
+    // And the code must be the one that made them
+    char state_path[PATH_MAX];
+    char hash[33];
+    char saved[33] = {0};
+    if (job_state_path(node, state_path, sizeof(state_path)) != 0) {
+        return 0;
+    }
+    node_code_hash(node, hash, sizeof(hash));
+    int fd = open(state_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, saved, sizeof(saved) - 1);
+    close(fd);
+    return n == 32 && strcmp(saved, hash) == 0;
+}
+
+// Remember the code that made the outputs of a succeeded job
+static void save_job_state(JOB *job) {
+    char state_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    char hash[33];
+    if (!job->whole || !job->node->outputs.size || job_state_path(job->node, state_path, sizeof(state_path)) != 0) {
+        return;
+    }
+    node_code_hash(job->node, hash, sizeof(hash));
+    int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", state_path, (long)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp_path)) {
+        return;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    int failed = write_all(fd, hash, 32) != 0;
+    close(fd);
+    if (failed || rename(tmp_path, state_path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Release what the current block of job holds
+static void finish_job_block(JOB *job) {
+    if (job->input.file_fd >= 0) {
+        close(job->input.file_fd);
+    }
+    if (job->temporary) {
+        remove_build(job->out_path);
+    }
+    job->input     = (CODE_INPUT){.file_fd = -1};
+    job->temporary = 0;
+}
+
+// Start the next runnable block of job. Returns 0 with the job running, 0
+// when the job has no blocks left, or the exit code of a failed start.
+static int start_job(JOB *job, char **args, int num_args) {
+    if (!job->root) {
+        args     = NULL;
+        num_args = 0;
+    }
+    for (; job->block != job->end; job->block = job->block->next) {
+        CODE_BLOCK *block = job->block;
+        if (!block->info.text || !block->code.text) {
+            continue;
+        }
+        const struct Executor *executor = block_executor(block);
+        if (!executor) {
+            error("%s: Unsupported language: %.*s\n", config.program, (int)block->info.size, block->info.text);
+            return 1;
+        }
+        log_info("Starting job: %.*s (%s)\n", (int)job->node->text.size, job->node->text.text, executor->lang);
+
+        LIMITS limits;
+        if (node_limits(job->node, &limits) != 0) {
+            return 1;
+        }
+        job->input    = (CODE_INPUT){.file_fd = -1, .output_fds = job->output ? job->output->child_fds : NULL};
+        int exit_code = 0;
+        if (executor->build_args_count > 0) {
+            exit_code = build_block(job->node, block, executor, &job->input, job->out_path, sizeof(job->out_path),
+                                    &job->temporary);
+            job->input.out_path = job->out_path;
+        }
+        if (exit_code == 0) {
+            exit_code = spawn_block(block, executor->prefix_args, executor->prefix_args_count, &job->input, args,
+                                    num_args, 1, &limits, &job->spawned);
+        }
+        if (exit_code != 0) {
+            finish_job_block(job);
+            return exit_code;
+        }
+        job->state = JOB_RUNNING;
+        return 0;
+    }
+    return 0;
+}
+
+// Name of job for its output: the heading, and the number of its block
+// when the blocks of the heading are jobs of their own
+static int job_name(JOB *job, char *buf, size_t size) {
+    int number = 1;
+    for (CODE_BLOCK *block = job->node->code_block; block && block != job->block; block = block->next) {
+        number++;
+    }
+    int n = job->whole ? snprintf(buf, size, "%.*s", (int)job->node->text.size, job->node->text.text)
+                       : snprintf(buf, size, "%.*s#%d", (int)job->node->text.size, job->node->text.text, number);
+    return n < 0 ? 0 : (size_t)n < size ? n : (int)size - 1;
+}
+
+// Release the output of a job that is done, unless it failed and is to be
+// reported
+static void end_job_output(JOB *job) {
+    if (job->output) {
+        output_close(job->output);
+        if (job->exit_code == 0) {
+            free_output(job->output);
+            job->output = NULL;
+        }
+    }
+}
+
+// Send sig to the process groups of the running jobs
+static void signal_jobs(JOB_LIST *list, int sig) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->jobs[i].state == JOB_RUNNING) {
+            kill(-list->jobs[i].spawned.pid, sig);
+        }
+    }
+}
+
+// Start a job whose deps are done, or finish it right away if it is up to
+// date, has nothing to run, or has a failed dep. Returns the exit code of
+// a job that is done, or -1 if it is running.
+static int advance_job(JOB_LIST *list, JOB *job, char **args, int num_args) {
+    for (size_t i = 0; i < job->dep_count; i++) {
+        if (list->jobs[job->deps[i]].exit_code != 0) {
+            job->state     = JOB_DONE;
+            job->exit_code = list->jobs[job->deps[i]].exit_code;
+            return job->exit_code;
+        }
+    }
+    if (job_up_to_date(list, job)) {
+        log_info("Up to date: %.*s\n", (int)job->node->text.size, job->node->text.text);
+        fprintf(stderr, "%s: %.*s is up to date\n", config.program, (int)job->node->text.size, job->node->text.text);
+        job->state = JOB_DONE;
+        return 0;
+    }
+
+    job->ran = 1;
+    if (list->name_width >= 0) {
+        char name[256];
+        int  size = job_name(job, name, sizeof(name));
+        if (!(job->output = output_open(name, (size_t)size, list->name_width))) {
+            job->state     = JOB_DONE;
+            job->exit_code = 1;
+            return 1;
+        }
+    }
+    int exit_code = start_job(job, args, num_args);
+    if (job->state == JOB_RUNNING) {
+        return -1;
+    }
+    job->state     = JOB_DONE;
+    job->exit_code = exit_code;
+    end_job_output(job);
+    if (exit_code == 0) {
+        save_job_state(job);
+    }
+    return exit_code;
+}
+
+// Whether the deps of job are done
+static int job_ready(JOB_LIST *list, JOB *job) {
+    for (size_t i = 0; i < job->dep_count; i++) {
+        if (list->jobs[job->deps[i]].state != JOB_DONE) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Run the jobs of node, at most max_jobs at a time. Unless keep_going, the
+// first failure stops starting jobs and terminates the running ones.
+// Returns the exit code of the first failed job, or 0.
+int exec_jobs(MD_NODE *node, char **args, int num_args, int max_jobs, int split, int keep_going) {
+    JOB_LIST list = {0};
+    if (collect_jobs(node, split, &list) != 0) {
+        free_jobs(&list);
+        return 1;
+    }
+    if (list.count == 0 || (list.count == 1 && !list.jobs[0].node->code_block && !list.jobs[0].dep_count)) {
+        free_jobs(&list);
+        log_info("no code blocks under this heading\n");
+        fprintf(stderr, "no code blocks under this heading\n");
+        return EXIT_FAILURE;
+    }
+    log_info("Running %zu jobs of %.*s, %d at a time\n", list.count, (int)node->text.size, node->text.text,
+             max_jobs);
+
+    struct sigaction saved[4];
+    int              caught = catch_signals(saved);
+    struct sigaction saved_alarm;
+    catch_alarm(&saved_alarm);
+
+    // Prefixes are padded to the widest name
+    list.name_width = -1;
+    if (config.output != OUTPUT_RAW && wake_pipe[0] >= 0) {
+        list.name_width = 0;
+        for (size_t i = 0; i < list.count; i++) {
+            char name[256];
+            int  width      = string_width_n(name, (size_t)job_name(&list.jobs[i], name, sizeof(name)));
+            list.name_width = width > list.name_width ? width : list.name_width;
+        }
+    }
+
+    int running   = 0;
+    int exit_code = 0;
+    int stopping  = 0;
+    while (1) {
+        // Start what is ready, in order. Finishing a job can make others
+        // ready, so go on until nothing changes.
+        for (int progress = 1; progress && !stopping;) {
+            progress = 0;
+            for (size_t i = 0; i < list.count && running < max_jobs && !stopping; i++) {
+                JOB *job = &list.jobs[i];
+                if (job->state != JOB_WAITING || !job_ready(&list, job)) {
+                    continue;
+                }
+                int code = advance_job(&list, job, args, num_args);
+                progress = 1;
+                if (code < 0) {
+                    running++;
+                } else if (code != 0) {
+                    if (!exit_code) {
+                        exit_code = code;
+                    }
+                    if (!keep_going) {
+                        stopping = 1;
+                        signal_jobs(&list, SIGTERM);
+                    }
+                }
+            }
+        }
+        if (running == 0) {
+            break;
+        }
+
+        // Wake up for the next deadline of the running jobs
+        double deadline = 0;
+        for (size_t i = 0; i < list.count; i++) {
+            if (list.jobs[i].state == JOB_RUNNING) {
+                double next = enforce_deadline(&list.jobs[i].spawned);
+                deadline    = next > 0 && (deadline == 0 || next < deadline) ? next : deadline;
+            }
+        }
+        arm_alarm(deadline);
+
+        int           status;
+        struct rusage usage;
+        pid_t         pid = wait_output(-1, &status, &usage);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                perror("wait4 failed");
+                break;
+            }
+            if (pending_signal) {
+                log_info("Forwarding signal %d to jobs\n", (int)pending_signal);
+                signal_jobs(&list, pending_signal);
+                if (!exit_code) {
+                    exit_code = 128 + pending_signal;
+                }
+                stopping       = 1;
+                pending_signal = 0;
+            }
+            continue;
+        }
+
+        JOB *job = NULL;
+        for (size_t i = 0; i < list.count; i++) {
+            if (list.jobs[i].state == JOB_RUNNING && list.jobs[i].spawned.pid == pid) {
+                job = &list.jobs[i];
+                break;
+            }
+        }
+        if (!job) {
+            continue;
+        }
+        running--;
+        int code = block_status(job->node, job->block, "exec", &job->spawned, status, &usage);
+        finish_job_block(job);
+
+        // Go on with the next block of the job. One stopped before its last
+        // block did not succeed, and is not up to date.
+        job->state = JOB_DONE;
+        if (code == 0 && job->block->next != job->end && stopping) {
+            log_info("Interrupted job: %.*s\n", (int)job->node->text.size, job->node->text.text);
+            code = exit_code ? exit_code : 1;
+        } else if (code == 0) {
+            job->block = job->block->next;
+            code       = start_job(job, args, num_args);
+            if (job->state == JOB_RUNNING) {
+                running++;
+                continue;
+            }
+        }
+        job->exit_code = code;
+        end_job_output(job);
+        if (code == 0) {
+            save_job_state(job);
+        } else if (!stopping) {
+            if (!exit_code) {
+                exit_code = code;
+            }
+            if (!keep_going) {
+                stopping = 1;
+                signal_jobs(&list, SIGTERM);
+            }
+        }
+    }
+
+    if (caught) {
+        release_signals(saved);
+    }
+    release_alarm(&saved_alarm);
+    for (size_t i = 0; i < list.count && list.count > 1; i++) {
+        if (list.jobs[i].output && list.jobs[i].state == JOB_DONE) {
+            output_report(list.jobs[i].output, list.jobs[i].exit_code);
+        }
+    }
+    free_jobs(&list);
+    return exit_code;
+}
+
+void show_hint(MD_NODE *doc_node) {
+    for (MD_NODE *current = doc_node; current; current = current->next) {
+        print_node_tree(doc_node, current);
+    }
+}
+
+void show_help() {
+    printf("Usage: %s [OPTIONS] [HEADING] [ARGS...]\n"
+           "HEADING is a heading text, or a path of headings such as dev/test\n"
+           "Options:\n"
+           "  -h, --help              Print this help message\n"
+           "  -c, --code [HEADING]    Print code block\n"
+           "  -1 [HEADING]            List one command per line\n"
+           "  -t, --tree [HEADING]    Print tree with description\n"
+           "  -f, --file [FILE]       Specify the file to parse, given again or as a glob for a workspace\n"
+           "  -l, --log-file [FILE]   Path to log file for diagnostics\n"
+           "  -j, --jobs=N            Run the blocks, or child headings, of HEADING N at a time\n"
+           "  -k, --keep-going        With -j, go on running jobs after one fails\n"
+           "      --no-cache          Do not read or write the parse cache\n"
+           "      --rebuild-cache     Parse the file and rewrite the parse cache\n"
+           "      --fast-scan         Scan the file without md4c where it is unambiguous\n"
+           "      --serve             Keep parsed files in memory for -1, -t and -c\n"
+           "      --watch             Run HEADING again each time its doc or inputs change\n"
+           "      --batch[=FILE]      Run the heading and args of each line of FILE, or stdin\n"
+           "      --session           Run consecutive blocks of one language in one interpreter\n"
+           "      --limits=LIST       Limit each block, as in timeout=30s,cpu=10,memory=1G\n"
+           "      --output=LIST       Show the output of jobs raw, by prefix or by group, and time\n"
+           "      --complete N WORDS  Print the completions of word N of WORDS\n"
+           "      --log-level=LEVEL   Log error, warn, info (default), debug or trace messages\n"
+           "      --timings[=json]    Report the time of each phase on stderr at exit\n",
+           config.program);
+}
+
+// Print what mode asks for about heading, or about the whole doc without
+// one: 'c' code, '1' one command per line, 't' tree, or 'r' the path of
+// the heading. Returns 1 if the heading is not found.
+int print_doc(MD_DOC *doc, const char *heading, char mode) {
+    if (!heading) {
+        log_info("No command specified, printing hints.\n");
+        if (mode == '1' && doc->root->level == 0) {
+            // Namespaced, as the headings of a workspace may repeat
+            for (MD_NODE *current = doc->root; current; current = current->next) {
+                print_one(current, current->text);
+            }
+        } else if (mode == '1') {
+            print_one(doc->root, (STR_VIEW){NULL, 0});
+        } else {
+            for (MD_NODE *current = doc->root; current; current = current->next) {
+                print_node_tree_with_desc(current);
+            }
+        }
+        return 0;
+    }
+
+    log_info("Looking for node_path '%s'\n", heading);
+    TimingMark mark;
+    timing_start(&mark);
+    MD_NODE *node = find_node(doc, heading);
+    timing_end(&mark, "find_node");
+    if (!node) {
+        error("Cannot find node: %s\n", heading);
+        return 1;
+    }
+    log_info("Found node: %.*s\n", (int)node->text.size, node->text.text);
+
+    if (mode == 'c') {
+        for (CODE_BLOCK *code_block = node->code_block; code_block; code_block = code_block->next) {
+            fwrite(code_block->code.text, 1, code_block->code.size, stdout);
+        }
+    } else if (mode == '1') {
+        print_one(node, (STR_VIEW){NULL, 0});
+    } else if (mode == 't') {
+        print_node_tree_with_desc(node);
+    } else if (mode == 'r') {
+        MD_NODE *path[node->level];
+        int      depth = 0;
+        for (MD_NODE *current = node; current && depth < node->level; current = current->parent) {
+            path[depth++] = current;
+        }
+        while (depth-- > 0) {
+            fwrite(path[depth]->text.text, 1, path[depth]->text.size, stdout);
+            putchar(depth ? '/' : '\n');
+        }
+    }
+    return 0;
+}
+
+// Completion
+//
+// `cr --complete CWORD WORDS...` prints the candidates for WORDS[CWORD], one
+// per line, for the completion script. WORDS are the words of the command
+// line, starting with the command name.
+
+static const char *complete_options[] = {
+    "-h", "--help", "-c", "--code", "-1", "-t", "--tree", "-f", "--file", "-l", "--log-file", "-j", "--jobs=",
+    "-k", "--keep-going", "--no-cache", "--rebuild-cache", "--fast-scan", "--serve", "--watch", "--batch", "--batch=", "--session", "--limits=", "--output=", "--log-level=", "--timings", "--timings=json",
+};
+
+static int has_prefix_case(STR_VIEW text, const char *prefix, size_t prefix_size) {
+    return text.size >= prefix_size && strncasecmp(text.text, prefix, prefix_size) == 0;
+}
+
+static int compare_node_order(const void *a, const void *b) {
+    unsigned int order_a = (*(MD_NODE *const *)a)->order;
+    unsigned int order_b = (*(MD_NODE *const *)b)->order;
+    return (order_a > order_b) - (order_a < order_b);
+}
+
+// Files and dirs starting with cur, only markdown files with docs_only
+static void complete_files(const char *cur, int docs_only) {
+    const char *slash = strrchr(cur, '/');
+    const char *base  = slash ? slash + 1 : cur;
+    char        dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - cur + 1) : 1, slash ? cur : ".");
+
+    DIR *dp = opendir(dir);
+    if (!dp) {
+        return;
+    }
+    size_t         base_size = strlen(base);
+    struct dirent *entry;
+    while ((entry = readdir(dp))) {
+        const char *name = entry->d_name;
+        if (strncmp(name, base, base_size) != 0 || (name[0] == '.' && base[0] != '.') || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        int         is_dir = fstatat(dirfd(dp), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        size_t      size   = strlen(name);
+        if (is_dir || !docs_only || (size > 3 && strcasecmp(name + size - 3, ".md") == 0)) {
+            printf("%.*s%s%s\n", (int)(base - cur), cur, name, is_dir ? "/" : "");
+        }
+    }
+    closedir(dp);
+}
+
+// Headings starting with cur, runnable ones unless all. A cur with a '/'
+// completes the children of the heading path before it.
+static void complete_headings(MD_DOC *doc, const char *cur, int all) {
+    const char *slash = strrchr(cur, '/');
+    if (slash) {
+        char parent_path[PATH_MAX];
+        snprintf(parent_path, sizeof(parent_path), "%.*s", (int)(slash - cur), cur);
+        MD_NODE *parent = slash == cur ? NULL : find_node(doc, parent_path);
+        MD_NODE *first  = parent ? parent->child : slash == cur ? doc->root : NULL;
+        size_t   size   = strlen(slash + 1);
+        for (MD_NODE *node = first; node; node = node->next) {
+            if (has_prefix_case(node->text, slash + 1, size) && (all || is_branch(node))) {
+                fwrite(cur, 1, (size_t)(slash - cur + 1), stdout);
+                str_view_print_lower(node->text, stdout);
+                putchar('\n');
+            }
+        }
+        return;
+    }
+
+    // One candidate per heading text, in document order
+    MD_NODE **matches = malloc((doc->index.count + 1) * sizeof(MD_NODE *));
+    if (!matches) {
+        return;
+    }
+    size_t count = 0;
+    size_t size  = strlen(cur);
+    for (size_t i = 0; i < doc->index.capacity; i++) {
+        MD_NODE *node = doc->index.slots[i];
+        if (!node || !has_prefix_case(node->text, cur, size)) {
+            continue;
+        }
+        while (node && !all && !is_branch(node)) {
+            node = node->next_same;
+        }
+        if (node) {
+            matches[count++] = node;
+        }
+    }
+    qsort(matches, count, sizeof(MD_NODE *), compare_node_order);
+    for (size_t i = 0; i < count; i++) {
+        str_view_print_lower(matches[i]->text, stdout);
+        putchar('\n');
+    }
+    free(matches);
+}
+
+// Add the docs of -f path as typed, where "~/" is not expanded yet
+static void complete_add_file(const char *path) {
+    char expanded[PATH_MAX];
+    if (strncmp(path, "~/", 2) == 0 && getenv("HOME")) {
+        snprintf(expanded, sizeof(expanded), "%s%s", getenv("HOME"), path + 1);
+        path = expanded;
+    }
+    add_file((char *)path);
+}
+
+// Print the candidates for words[cword] of the count words
+int complete(int cword, char **words, int count) {
+    const char *cur = cword < count ? words[cword] : "";
+    int         all = 0;
+
+    // Options before cur, as main() reads them
+    for (int i = 1; i < cword && i < count; i++) {
+        const char *word = words[i];
+        if (word[0] != '-' || !word[1]) {
+            return 0; // A heading, its args are not completed
+        }
+        if (word[1] == '-') {
+            if (strcmp(word, "--tree") == 0) {
+                all = 1;
+            } else if (strncmp(word, "--file=", 7) == 0) {
+                complete_add_file(word + 7);
+            } else if (strcmp(word, "--file") == 0 || strcmp(word, "--log-file") == 0) {
+                int is_file = strcmp(word, "--file") == 0;
+                if (i + 1 == cword) {
+                    complete_files(cur, is_file);
+                    return 0;
+                }
+                if (is_file) {
+                    complete_add_file(words[i + 1]);
+                }
+                i++;
+            }
+            continue;
+        }
+        for (const char *c = word + 1; *c; c++) {
+            if (*c == 't') {
+                all = 1;
+            } else if (*c == 'f' || *c == 'l' || *c == 'j') {
+                if (c[1]) {
+                    if (*c == 'f') {
+                        complete_add_file(c + 1);
+                    }
+                } else if (i + 1 == cword) {
+                    if (*c != 'j') {
+                        complete_files(cur, *c == 'f');
+                    }
+                    return 0;
+                } else {
+                    if (*c == 'f') {
+                        complete_add_file(words[i + 1]);
+                    }
+                    i++;
+                }
+                break;
+            }
+        }
+    }
+
+    if (cur[0] == '-') {
+        size_t size = strlen(cur);
+        for (size_t i = 0; i < sizeof(complete_options) / sizeof(complete_options[0]); i++) {
+            if (strncmp(complete_options[i], cur, size) == 0) {
+                puts(complete_options[i]);
+            }
+        }
+        return 0;
+    }
+
+    // The headings of a workspace are under the namespace of each doc
+    if (config.files.gl_pathc > 1) {
+        if (load_workspace(config.files.gl_pathv, config.files.gl_pathc)) {
+            complete_headings(&doc, cur, all);
+        }
+        free_workspace();
+        free_doc(&doc);
+        return 0;
+    }
+    const char *file_path = config.files.gl_pathc ? config.files.gl_pathv[0] : find_doc(config.program);
+    if (!file_path) {
+        return 1;
+    }
+    MD_DOC completed = {0};
+    if (load_doc((char *)file_path, &completed, NULL)) {
+        complete_headings(&completed, cur, all);
+    }
+    free_doc(&completed);
+    return 0;
+}
+
+// Serve
+//
+// `cr --serve` keeps parsed docs in memory and answers print_doc() requests
+// on a Unix socket. A request is one SOCK_SEQPACKET message holding the mode,
+// the doc path, the heading and the client's MD_<LANG> variables, and carries
+// the client's stdout and stderr, which the output is written to directly.
+// The reply is the exit status. Docs are dropped when inotify reports a
+// change, and checked with stat() on every request.
+
+#define SERVE_VERSION "cr2"
+#define SERVE_REQUEST_MAX 65536
+
+typedef struct SERVED_DOC {
+    char              *path;
+    MD_DOC             doc;
+    struct stat        st;
+    int                wd; // inotify watch, or -1
+    struct SERVED_DOC *next;
+} SERVED_DOC;
+
+static volatile sig_atomic_t serve_stopped = 0;
+
+static void stop_serving(int sig) {
+    (void)sig;
+    serve_stopped = 1;
+}
+
+// Socket path, `$XDG_RUNTIME_DIR/cr.sock` or `cr.sock` in the cache dir
+static int get_socket_path(struct sockaddr_un *addr) {
+    char        dir[PATH_MAX];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && runtime_dir[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", runtime_dir);
+    } else if (get_cache_dir(dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n            = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/cr.sock", dir);
+    return n > 0 && (size_t)n < sizeof(addr->sun_path) ? 0 : -1;
+}
+
+static int same_file(const struct stat *a, const struct stat *b) {
+    struct timespec a_mtime = stat_mtime(a);
+    struct timespec b_mtime = stat_mtime(b);
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           timespec_cmp(&a_mtime, &b_mtime) == 0;
+}
+
+static void drop_served_doc(SERVED_DOC **docs, SERVED_DOC *served, int inotify_fd) {
+    for (SERVED_DOC **link = docs; *link; link = &(*link)->next) {
+        if (*link == served) {
+            *link = served->next;
+            break;
+        }
+    }
+    log_info("Dropping doc: %s\n", served->path);
+    if (served->wd >= 0 && inotify_fd >= 0) {
+        inotify_rm_watch(inotify_fd, served->wd);
+    }
+    free_doc(&served->doc);
+    free(served->path);
+    free(served);
+}
+
+// The parsed doc at path, loading it if it is new or has changed
+static SERVED_DOC *get_served_doc(SERVED_DOC **docs, const char *path, int inotify_fd) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        error("Cannot open %s\n", path);
+        return NULL;
+    }
+    for (SERVED_DOC *served = *docs; served; served = served->next) {
+        if (strcmp(served->path, path) == 0) {
+            if (same_file(&served->st, &st)) {
+                return served;
+            }
+            drop_served_doc(docs, served, inotify_fd);
+            break;
+        }
+    }
+
+    SERVED_DOC *served = calloc(1, sizeof(SERVED_DOC));
+    if (!served || !(served->path = strdup(path))) {
+        free(served);
+        error("Memory allocation failed\n");
+        return NULL;
+    }
+    if (!load_doc(served->path, &served->doc, NULL)) {
+        free_doc(&served->doc);
+        free(served->path);
+        free(served);
+        return NULL;
+    }
+    served->st = st;
+    served->wd = -1;
+#ifdef __linux__
+    if (inotify_fd >= 0) {
+        served->wd = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+#endif
+    served->next = *docs;
+    *docs        = served;
+    log_info("Serving doc: %s\n", path);
+    return served;
+}
+
+static int is_custom_executor_var(const char *entry) {
+    return strncmp(entry, "MD_", 3) == 0 && strchr(entry, '=');
+}
+
+// Take the MD_<LANG> variables of the client, "NAME=VALUE\0" each, dropping
+// the executors and the docs resolved with others
+static int use_client_env(SERVED_DOC **docs, const char *env, size_t size, int inotify_fd) {
+    static char  *served_env      = NULL;
+    static size_t served_env_size = 0;
+    if (served_env && served_env_size == size && memcmp(served_env, env, size) == 0) {
+        return 0;
+    }
+    char *copy = malloc(size + 1);
+    if (!copy) {
+        error("Memory allocation failed\n");
+        return -1;
+    }
+    memcpy(copy, env, size);
+    copy[size] = '\0';
+    free(served_env);
+    served_env      = copy;
+    served_env_size = size;
+
+    extern char **environ;
+    for (char **entry = environ; *entry;) {
+        if (is_custom_executor_var(*entry)) {
+            char name[256];
+            int  len = (int)(strchr(*entry, '=') - *entry);
+            if (len < (int)sizeof(name)) {
+                snprintf(name, sizeof(name), "%.*s", len, *entry);
+                unsetenv(name);
+                continue;
+            }
+        }
+        entry++;
+    }
+    for (char *entry = copy; entry < copy + size; entry += strlen(entry) + 1) {
+        char *eq = strchr(entry, '=');
+        if (is_custom_executor_var(entry)) {
+            *eq = '\0';
+            setenv(entry, eq + 1, 1);
+            *eq = '=';
+        }
+    }
+
+    // Blocks keep the executor they were resolved to
+    free_custom_executors();
+    while (*docs) {
+        drop_served_doc(docs, *docs, inotify_fd);
+    }
+    log_info("Serving with the MD_ variables of the client\n");
+    return 0;
+}
+
+// Answer one request on client
+static void serve_request(SERVED_DOC **docs, int client, int inotify_fd) {
+    static char   request[SERVE_REQUEST_MAX];
+    char          control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec  iov = {request, sizeof(request) - 1};
+    struct msghdr msg = {0};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC);
+    int     fds[2] = {-1, -1};
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+    }
+
+    // "<version>\0<mode>\0<doc path>\0<heading>\0" and "NAME=VALUE\0" for
+    // each MD_ variable, the heading may be empty
+    const char *fields[4] = {NULL};
+    size_t      start     = 0;
+    if (n > 0 && !(msg.msg_flags & MSG_TRUNC)) {
+        request[n] = '\0';
+        for (int i = 0; i < 4 && start < (size_t)n; i++) {
+            fields[i] = request + start;
+            start += strlen(fields[i]) + 1;
+        }
+    }
+    int status = -1;
+    if (fds[0] >= 0 && fds[1] >= 0 && fields[3] && strcmp(fields[0], SERVE_VERSION) == 0 && fields[1][0] &&
+        !fields[1][1] && use_client_env(docs, request + start, start < (size_t)n ? (size_t)n - start : 0,
+                                        inotify_fd) == 0) {
+        // Write the output, and the errors, where the client would have
+        fflush(stdout);
+        fflush(stderr);
+        int saved_out = dup(STDOUT_FILENO);
+        int saved_err = dup(STDERR_FILENO);
+        dup2(fds[0], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+
+        SERVED_DOC *served = get_served_doc(docs, fields[2], inotify_fd);
+        status = served ? print_doc(&served->doc, fields[3][0] ? fields[3] : NULL, fields[1][0]) : EXIT_FAILURE;
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+
+    char reply[16];
+    int  reply_size = snprintf(reply, sizeof(reply), "%d", status);
+    send(client, reply, (size_t)reply_size, MSG_NOSIGNAL);
+}
+
+// Run the daemon until SIGINT or SIGTERM
+int serve(void) {
+    struct sockaddr_un addr;
+    if (get_socket_path(&addr) != 0) {
+        error("Cannot resolve the socket path\n");
+        return 1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket failed");
+        return 1;
+    }
+    // Take over the socket of a daemon that is gone, but not of a live one
+    if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        error("Already serving on %s\n", addr.sun_path);
+        close(listen_fd);
+        return 1;
+    }
+    close(listen_fd);
+    unlink(addr.sun_path);
+
+    listen_fd  = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    mode_t old = umask(077);
+    int    ok  = listen_fd >= 0 && bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+             listen(listen_fd, 64) == 0;
+    umask(old);
+    if (!ok) {
+        perror("Cannot listen");
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return 1;
+    }
+    log_info("Serving on %s\n", addr.sun_path);
+    fprintf(stderr, "%s: serving on %s\n", config.program, addr.sun_path);
+
+    int inotify_fd = -1;
+#ifdef __linux__
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
+    struct sigaction stop = {0};
+    stop.sa_handler       = stop_serving;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    SERVED_DOC *docs = NULL;
+    while (!serve_stopped) {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+        if (poll(fds, inotify_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            break;
+        }
+
+#ifdef __linux__
+        if (inotify_fd >= 0 && (fds[1].revents & POLLIN)) {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len;) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    for (SERVED_DOC *served = docs; served; served = served->next) {
+                        if (served->wd == event->wd) {
+                            if (event->mask & IN_IGNORED) {
+                                served->wd = -1;
+                            }
+                            drop_served_doc(&docs, served, inotify_fd);
+                            break;
+                        }
+                    }
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+#endif
+
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve_request(&docs, client, inotify_fd);
+                close(client);
+            }
+        }
+    }
+
+    while (docs) {
+        drop_served_doc(&docs, docs, inotify_fd);
+    }
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+    close(listen_fd);
+    unlink(addr.sun_path);
+    return 0;
+}
 
-    // Initialize parser with complete callback structure
-    MD_PARSER parser   = {0}; // Zero initialize all fields
-    parser.abi_version = 0;
-    parser.flags       = MD_DIALECT_GITHUB;
-    parser.enter_block = enter_block_callback;
-    parser.leave_block = leave_block_callback;
-    parser.enter_span  = enter_span_callback;
-    parser.leave_span  = leave_span_callback;
-    parser.text        = text_callback;
+// Ask a running daemon to print mode about heading of the doc at doc_path.
+// Returns the exit status, or -1 if there is no daemon to ask.
+int serve_client(const char *doc_path, const char *heading, char mode) {
+    struct sockaddr_un addr;
+    char               real_path[PATH_MAX];
+    if (get_socket_path(&addr) != 0 || !realpath(doc_path, real_path)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
 
-    int result = md_parse(buffer, bytes_read, &parser, &data);
+    static char request[SERVE_REQUEST_MAX];
+    int size = snprintf(request, sizeof(request), "%s%c%c%c%s%c%s", SERVE_VERSION, '\0', mode, '\0', real_path, '\0',
+                        heading ? heading : "");
+    if (size < 0 || (size_t)size + 1 >= sizeof(request)) {
+        close(fd);
+        return -1;
+    }
+    // The executors of the daemon are the ones of this environment
+    extern char **environ;
+    for (char **entry = environ; *entry; entry++) {
+        if (is_custom_executor_var(*entry)) {
+            size_t len = strlen(*entry) + 1;
+            if ((size_t)size + 1 + len >= sizeof(request)) {
+                close(fd);
+                return -1;
+            }
+            memcpy(request + size + 1, *entry, len);
+            size += (int)len;
+        }
+    }
 
-    if (result != 0) {
-        error("Markdown parsing failed with code %d\n", result);
-        // } else {
-        //     error( "Parsing completed successfully\n");
+    int           out_fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char          control[CMSG_SPACE(sizeof(out_fds))];
+    struct iovec  iov = {request, (size_t)size + 1};
+    struct msghdr msg = {0};
+    memset(control, 0, sizeof(control));
+    msg.msg_iov                = &iov;
+    msg.msg_iovlen             = 1;
+    msg.msg_control            = control;
+    msg.msg_controllen         = sizeof(control);
+    struct cmsghdr *cmsg       = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level           = SOL_SOCKET;
+    cmsg->cmsg_type            = SCM_RIGHTS;
+    cmsg->cmsg_len             = CMSG_LEN(sizeof(out_fds));
+    memcpy(CMSG_DATA(cmsg), out_fds, sizeof(out_fds));
+
+    fflush(stdout);
+    char    reply[16];
+    ssize_t n = -1;
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)size + 1) {
+        while ((n = recv(fd, reply, sizeof(reply) - 1, 0)) < 0 && errno == EINTR) {
+        }
     }
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    reply[n]   = '\0';
+    int status = atoi(reply);
+    log_info("Served by daemon, status %d\n", status);
+    return status;
+}
 
-    free(buffer);
-    return data.root;
+// Watch
+//
+// `cr --watch HEADING` runs the heading, then runs it again each time its
+// doc or a file matching the "inputs:" of its section changes, killing the
+// run still going first. Changes are noticed with inotify on the dirs of
+// those files, or by looking at them every WATCH_POLL_MS without it, and
+// are debounced until WATCH_DEBOUNCE_MS pass without another. A change of
+// the inputs only runs the same tree again. A change of the doc parses
+// only the section of the heading again, unless the section has deps,
+// which can be anywhere, and does not run it if the section is the same.
+
+#define WATCH_POLL_MS     500
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_KILL_MS     1000 // Before a run that ignores SIGTERM gets SIGKILL
+
+static volatile sig_atomic_t watch_stopped = 0;
+
+static void stop_watching(int sig) {
+    (void)sig;
+    watch_stopped = 1;
+}
+
+// Watch the dir of path, which need not exist yet
+static void watch_dir(int inotify_fd, const char *path) {
+#ifdef __linux__
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (inotify_fd >= 0) {
+        inotify_add_watch(inotify_fd, dirname(dir),
+                          IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    }
+#else
+    (void)inotify_fd;
+    (void)path;
+#endif
 }
 
-MD_NODE *find_node(MD_NODE *root, char *heading) {
-    MD_NODE *current = root;
-    while (current) {
-        log_printf("current=%s\n", current->text);
-        if (current->text && strcasecmp(current->text, heading) == 0) {
-            return current;
+// Hash of the paths, sizes and times of the files matching the inputs of
+// node and its children, watching their dirs
+static uint64_t watch_inputs(MD_NODE *node, uint64_t hash, int inotify_fd) {
+    STR_VIEW inputs = node->inputs;
+    for (STR_VIEW word = next_word(&inputs); word.text; word = next_word(&inputs)) {
+        char   pattern[PATH_MAX];
+        glob_t matches;
+        snprintf(pattern, sizeof(pattern), "%.*s", (int)word.size, word.text);
+        watch_dir(inotify_fd, pattern);
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            continue;
         }
-        if (current->child) {
-            MD_NODE *result = find_node(current->child, heading);
-            if (result) {
-                return result;
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            struct stat st;
+            hash = fnv1a_64_update(hash, matches.gl_pathv[i], strlen(matches.gl_pathv[i]) + 1);
+            if (stat(matches.gl_pathv[i], &st) == 0) {
+                hash = fnv1a_64_update(hash, &st.st_size, sizeof(st.st_size));
+                struct timespec mtime = stat_mtime(&st);
+                hash                  = fnv1a_64_update(hash, &mtime, sizeof(mtime));
             }
+            watch_dir(inotify_fd, matches.gl_pathv[i]);
         }
-        current = current->next;
+        globfree(&matches);
     }
-    return NULL;
+    for (MD_NODE *child = node->child; child; child = child->next) {
+        hash = watch_inputs(child, hash, inotify_fd);
+    }
+    return hash;
+}
+
+// Hash of what the section of node runs
+static uint64_t section_hash(MD_NODE *node, uint64_t hash) {
+    STR_VIEW fields[6] = {node->text, node->description, node->deps, node->inputs, node->outputs, node->limits};
+    for (int i = 0; i < 6; i++) {
+        hash = fnv1a_64_update(hash, fields[i].text, fields[i].size);
+        hash = fnv1a_64_update(hash, "", 1);
+    }
+    for (CODE_BLOCK *block = node->code_block; block; block = block->next) {
+        hash = fnv1a_64_update(hash, block->info.text, block->info.size);
+        hash = fnv1a_64_update(hash, "\n", 1);
+        hash = fnv1a_64_update(hash, block->code.text, block->code.size);
+    }
+    for (MD_NODE *child = node->child; child; child = child->next) {
+        hash = fnv1a_64_update(hash, "{", 1);
+        hash = section_hash(child, hash);
+        hash = fnv1a_64_update(hash, "}", 1);
+    }
+    return hash;
 }
 
-int get_max_branch_width(MD_NODE *node) {
-    int max = 0;
+static int section_has_deps(MD_NODE *node) {
+    if (node->deps.size) {
+        return 1;
+    }
+    for (MD_NODE *child = node->child; child; child = child->next) {
+        if (section_has_deps(child)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    for (MD_NODE *current_node = node->child; current_node; current_node = current_node->next) {
-        if (current_node->code_block && get_executor(current_node->code_block->info) || current_node->child) {
-            int w1 = (current_node->level - 1) * 4 + string_width(current_node->text);
-            if (w1 > max) {
-                max = w1;
-            }
-            int w2 = get_max_branch_width(current_node);
-            if (w2 > max) {
-                max = w2;
-            }
+// Parse the changed doc again, as a whole or only up to the section of
+// heading, and find heading in it
+static MD_NODE *watch_reload(const char *heading, int whole) {
+    if (workspace_count) {
+        free_workspace();
+        free_doc(&doc);
+        if (!load_workspace(config.files.gl_pathv, config.files.gl_pathc)) {
+            return NULL;
+        }
+    } else {
+        free_doc(&doc);
+        if (!(doc.root = parse_file(config.file_path, &doc, whole ? NULL : heading))) {
+            return NULL;
         }
+        doc.partial = !whole;
+    }
+    MD_NODE *node = find_node(&doc, heading);
+    if (!node) {
+        error("Cannot find node: %s\n", heading);
     }
-    return max;
+    return node;
 }
 
-void node_to_tree_with_desc(MD_NODE *node, Tree *parent, int max_branch_width) {
-    for (MD_NODE *current_node = node->child; current_node; current_node = current_node->next) {
-        if (current_node->code_block && get_executor(current_node->code_block->info) || current_node->child) {
-            // Repeated seperators
-            int   seps_count = max_branch_width - (current_node->level - 1) * 4 - string_width(current_node->text);
-            char *seperators = malloc(seps_count + 1);
-            if (!seperators) {
-                error("Memory allocation failed\n");
-                exit(EXIT_FAILURE);
-            }
-            memset(seperators, ' ', seps_count);
-            seperators[seps_count] = '\0';
+// Run node in a child leading its own process group, so that it can be
+// killed with its children, writing to output_fds if not NULL, as for
+// output_detach().
+static pid_t run_detached(MD_NODE *node, char **args, int num_args, const int *output_fds) {
+    fflush(stdout);
+    fflush(stderr);
+    log_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid > 0) {
+        setpgid(pid, pid);
+        return pid;
+    }
 
-            char *branch_val           = malloc(1024);
-            char *heading_text_lowered = strdup(current_node->text);
-            tolower_in_place(heading_text_lowered);
-            sprintf(branch_val, "%s %s %s", heading_text_lowered, seperators, current_node->description ? current_node->description : "");
-            Tree *current_tree = add_node(parent, branch_val);
-            node_to_tree_with_desc(current_node, current_tree, max_branch_width);
+    setpgid(0, 0);
+    forget_signals();
+    output_detach(output_fds);
+    if (isatty(STDIN_FILENO)) {
+        // A background process group would be stopped reading the terminal
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
         }
     }
+    WORKSPACE_DOC *owner = workspace_doc(node);
+    if (owner) {
+        config.file_path = owner->path;
+        setenv("CR_FILE", owner->path, 1);
+    }
+    export_snapshot(config.file_path, owner ? &owner->doc : &doc);
+    int exit_code;
+    if (config.jobs || has_directives(node)) {
+        exit_code = exec_jobs(node, args, num_args, config.jobs ? config.jobs : 1, config.jobs, config.keep_going);
+    } else {
+        exit_code = exec_node(node, args, num_args);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    log_flush();
+    _exit(exit_code);
 }
 
-void print_node_tree_with_desc(MD_NODE *node) {
-    int   max_branch_width = get_max_branch_width(node);
-    Tree *docTree          = new_tree(node->text);
-    node_to_tree_with_desc(node, docTree, max_branch_width);
-    char *tree_str = print_tree(docTree);
-    printf("%s", tree_str);
+// Reap the run if it is done, and log its exit code
+static void watch_reap(pid_t *running, int options) {
+    int status;
+    if (*running > 0 && waitpid(*running, &status, options) == *running) {
+        log_info("Run exit code: %d\n", WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+        *running = -1;
+    }
 }
 
-void print_one(MD_NODE *node) {
-    for (MD_NODE *current_node = node->child; current_node; current_node = current_node->next) {
-        if (current_node->code_block && get_executor(current_node->code_block->info)) {
-            char *heading_text_lowered = strdup(current_node->text);
-            tolower_in_place(heading_text_lowered);
-            printf("%s\n", heading_text_lowered);
-            print_one(current_node);
-        } else if (current_node->child) {
-            print_one(current_node);
+static void watch_kill(pid_t *running) {
+    if (*running <= 0) {
+        return;
+    }
+    log_info("Killing run: %d\n", (int)*running);
+    kill(-*running, SIGTERM);
+    for (int waited = 0; *running > 0 && waited < WATCH_KILL_MS; waited += 10) {
+        watch_reap(running, WNOHANG);
+        if (*running > 0) {
+            poll(NULL, 0, 10);
         }
     }
+    if (*running > 0) {
+        kill(-*running, SIGKILL);
+        watch_reap(running, 0);
+    }
 }
 
-char *str_replace_all(const char *source, const char *old, const char *new) {
-    if (!source || !old || !new || old[0] == '\0') {
-        return NULL;
+// Wait until the watched files may have changed, reaping the run when it
+// is done. Returns 0 once the events stop for WATCH_DEBOUNCE_MS, each
+// WATCH_POLL_MS without inotify, or -1 if stopped.
+static int watch_wait(int inotify_fd, pid_t *running) {
+    int timeout = WATCH_POLL_MS;
+    int events  = 0;
+    while (!watch_stopped) {
+        struct pollfd fds[1] = {{inotify_fd, POLLIN, 0}};
+        int           ready  = poll(fds, inotify_fd >= 0 ? 1 : 0, timeout);
+        watch_reap(running, WNOHANG);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            return -1;
+        }
+        if (ready == 0) {
+            if (events || inotify_fd < 0) {
+                return 0;
+            }
+            continue;
+        }
+        char buf[4096] __attribute__((aligned(8)));
+        while (read(inotify_fd, buf, sizeof(buf)) > 0) {
+        }
+        events  = 1;
+        timeout = WATCH_DEBOUNCE_MS;
     }
+    return -1;
+}
 
-    size_t old_len = strlen(old);
-    size_t new_len = strlen(new);
-    size_t count   = 0;
-    for (const char *result = strstr(source, old); result;
-         result             = strstr(result + old_len, old)) {
-        count++;
+// Run node, found as heading, again on each change until SIGINT or SIGTERM
+int watch(MD_NODE *node, const char *heading, char **args, int num_args) {
+    struct sigaction stop = {0};
+    stop.sa_handler       = stop_watching;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    WORKSPACE_DOC *owner      = workspace_doc(node);
+    const char    *doc_path   = owner ? owner->path : config.file_path;
+    uint64_t       section    = section_hash(node, 0xcbf29ce484222325ULL);
+    uint64_t       inputs     = 0;
+    int            changed    = 1;
+    pid_t          running    = -1;
+    int            inotify_fd = -1;
+    struct stat    doc_st;
+    if (stat(doc_path, &doc_st) != 0) {
+        memset(&doc_st, 0, sizeof(doc_st));
     }
 
-    size_t source_len = strlen(source);
-    size_t target_len = source_len + count * (new_len - old_len) + 1;
-    char  *target     = malloc(target_len);
-    if (!target) {
-        return NULL;
+    while (!watch_stopped) {
+        // Watch afresh each time, as the files and their dirs can come and go
+        if (inotify_fd >= 0) {
+            close(inotify_fd);
+        }
+#ifdef __linux__
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        watch_dir(inotify_fd, doc_path);
+        if (node) {
+            uint64_t stamp = watch_inputs(node, 0xcbf29ce484222325ULL, inotify_fd);
+            if (stamp != inputs && !changed) {
+                log_info("Inputs changed\n");
+                changed = 1;
+            }
+            inputs = stamp;
+        }
+        if (node && changed) {
+            watch_kill(&running);
+            running = run_detached(node, args, num_args, NULL);
+            changed = 0;
+        }
+
+        if (watch_wait(inotify_fd, &running) != 0) {
+            break;
+        }
+        struct stat st;
+        if (stat(doc_path, &st) != 0 || same_file(&st, &doc_st)) {
+            continue;
+        }
+        doc_st = st;
+        log_info("Doc changed: %s\n", doc_path);
+
+        int deps  = !node || section_has_deps(node);
+        int whole = deps || workspace_count;
+        node      = watch_reload(heading, whole);
+        if (node) {
+            owner          = workspace_doc(node);
+            doc_path       = owner ? owner->path : config.file_path;
+            uint64_t fresh = section_hash(node, 0xcbf29ce484222325ULL);
+            changed        = deps || fresh != section;
+            section        = fresh;
+            if (!changed) {
+                log_info("Section unchanged\n");
+            }
+        }
+    }
+
+    watch_kill(&running);
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
     }
+    return 0;
+}
+
+// Batch
+//
+// `cr --batch[=FILE]` runs records of a heading and its args, read from
+// FILE or stdin, all from the doc parsed once: in order, or N at a time
+// with -j. A record is a line of words, split on blanks and quoted as in a
+// shell but without expansions, or, when the input has a NUL in it, words
+// each ending with a NUL and the record with an empty one. Every heading is
+// found before any record runs. Each record runs as by run_detached() and,
+// as with jobs, unless -k a failed record stops the others. The exit code
+// of each is printed on stderr as JSON at the end.
 
-    // printf("count=%ld\n", count);
+typedef struct {
+    size_t          number; // Line, or record, in the input
+    size_t          word;   // Index of the heading in the words
+    int             argc;   // Words of the record, with the heading
+    MD_NODE        *node;
+    pid_t           pid;
+    int             state;
+    int             exit_code; // -1 if it did not run
+    TimingMark      spawn;
+    TimingMark      spawned;
+    struct timespec start;
+    double          wall_ms;
+    OUTPUT         *output; // Captured with --output
+} BATCH_RECORD;
 
-    size_t target_index = 0;
-    for (size_t source_index = 0; source[source_index] != '\0';) {
-        if (strncmp(source + source_index, old, old_len) == 0) {
-            memcpy(target + target_index, new, new_len);
-            source_index += old_len;
-            target_index += new_len;
+typedef struct {
+    char        **words;
+    size_t        word_count;
+    size_t        word_capacity;
+    BATCH_RECORD *records;
+    size_t        record_count;
+    size_t        record_capacity;
+} BATCH;
+
+static char *read_batch(const char *path, size_t *size) {
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd < 0) {
+        error("Cannot open %s\n", path);
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char  *buf      = malloc(capacity);
+    *size           = 0;
+    while (buf) {
+        if (*size + 1 >= capacity) {
+            char *grown = realloc(buf, capacity * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buf + *size, capacity - *size - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("read failed");
+            free(buf);
+            buf = NULL;
+        } else if (n == 0) {
+            buf[*size] = '\0';
+            break;
         } else {
-            target[target_index++] = source[source_index++];
+            *size += (size_t)n;
         }
     }
-
-    target[target_index] = '\0';
-    // printf("target=%s\n", target);
-    return target;
+    if (path) {
+        close(fd);
+    }
+    if (!buf && errno == ENOMEM) {
+        error("Memory allocation failed\n");
+    }
+    return buf;
 }
 
-// Execute code blocks for a given node
-int exec_node(MD_NODE *node, char **args, int num_args) {
-    int exit_code;
-    if (!node->code_block) {
-        log_printf("no code blocks under this heading\n");
-        fprintf(stderr, "no code blocks under this heading\n");
-        return EXIT_FAILURE;
+static int batch_add_word(BATCH *batch, char *word) {
+    if (batch->word_count == batch->word_capacity) {
+        size_t capacity = batch->word_capacity ? batch->word_capacity * 2 : 64;
+        char **words    = realloc(batch->words, capacity * sizeof(char *));
+        if (!words) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        batch->words         = words;
+        batch->word_capacity = capacity;
     }
-    log_printf("Executing node: %s\n", node->text);
+    batch->words[batch->word_count++] = word;
+    return 0;
+}
 
-    log_printf("Setting up environment variables\n");
-    // First collect all nodes from root to target in a stack
-    log_printf("Env stack size: %d\n", node->level);
-    MD_NODE *stack[node->level];
-    int      stack_size = 0;
-    MD_NODE *current    = node;
-    while (current) {
-        stack[stack_size++] = current;
-        current             = current->parent;
+// End the record of the words from first on, unless there are none
+static int batch_add_record(BATCH *batch, size_t number, size_t first) {
+    if (batch->word_count == first) {
+        return 0;
+    }
+    if (batch->record_count == batch->record_capacity) {
+        size_t        capacity = batch->record_capacity ? batch->record_capacity * 2 : 16;
+        BATCH_RECORD *records  = realloc(batch->records, capacity * sizeof(BATCH_RECORD));
+        if (!records) {
+            error("Memory allocation failed\n");
+            return -1;
+        }
+        batch->records         = records;
+        batch->record_capacity = capacity;
     }
+    batch->records[batch->record_count++] =
+        (BATCH_RECORD){.number = number, .word = first, .argc = (int)(batch->word_count - first), .exit_code = -1};
+    return 0;
+}
 
-    CODE_BLOCK *block = node->code_block;
-    while (block) {
-        if (block->info && block->code) {
-            const char            *lang     = block->info;
-            const struct Executor *executor = get_executor(lang);
+static int is_batch_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-            if (executor) {
-                log_printf("Executing code block: \n```%s\n%s```\n", block->info,
-                           block->code);
-                log_printf("Using language profile: %s\n", executor->lang);
-
-                // Fork and execute
-                pid_t pid = fork();
-                if (pid == -1) {
-                    perror("fork failed");
-                    return 1;
+// Split the line in [in, end) into words in place. A line starting with
+// '#' is a comment.
+static int batch_split_line(BATCH *batch, char *in, char *end, size_t number) {
+    char  *out   = in;
+    size_t first = batch->word_count;
+    while (in < end && is_batch_blank(*in)) {
+        in++;
+    }
+    if (in < end && *in == '#') {
+        return 0;
+    }
+    while (in < end) {
+        char *word  = out;
+        char  quote = 0;
+        while (in < end && (quote || !is_batch_blank(*in))) {
+            char c = *in++;
+            if (quote == '\'') {
+                if (c == '\'') {
+                    quote = 0;
+                } else {
+                    *out++ = c;
                 }
+            } else if (c == '\\' && in < end && (!quote || *in == '"' || *in == '\\')) {
+                *out++ = *in++;
+            } else if (c == '"' && quote) {
+                quote = 0;
+            } else if ((c == '\'' || c == '"') && !quote) {
+                quote = c;
+            } else {
+                *out++ = c;
+            }
+        }
+        if (quote) {
+            error("Unterminated quote on line %zu\n", number);
+            return -1;
+        }
+        // Past the blanks after the word, out is behind in
+        while (in < end && is_batch_blank(*in)) {
+            in++;
+        }
+        *out++ = '\0';
+        if (batch_add_word(batch, word) != 0) {
+            return -1;
+        }
+    }
+    return batch_add_record(batch, number, first);
+}
 
-                if (pid == 0) {
-                    // Child process
-                    // Calculate number of arguments needed
-                    int total_args = executor->prefix_args_count; // Prefix arguments
-                    if (num_args > 0)
-                        total_args += num_args; // User arguments
-
-                    // Allocate argument array
-                    char **exec_args = calloc(total_args + 1, sizeof(char *));
-                    if (!exec_args) {
-                        _exit(1);
-                    }
+// Split the input of size, ending with one more '\0', into the records
+static int batch_parse(BATCH *batch, char *buf, size_t size) {
+    size_t number = 1;
+    if (memchr(buf, '\0', size)) {
+        size_t first = 0;
+        for (char *word = buf; word < buf + size;) {
+            char *end = word + strlen(word);
+            if (end == word) {
+                if (batch_add_record(batch, number++, first) != 0) {
+                    return -1;
+                }
+                first = batch->word_count;
+            } else if (batch_add_word(batch, word) != 0) {
+                return -1;
+            }
+            word = end + 1;
+        }
+        return batch_add_record(batch, number, first);
+    }
+    for (char *line = buf; line < buf + size; number++) {
+        char *end = memchr(line, '\n', (size_t)(buf + size - line));
+        end       = end ? end : buf + size;
+        if (batch_split_line(batch, line, end, number) != 0) {
+            return -1;
+        }
+        line = end + 1;
+    }
+    return 0;
+}
 
-                    // Fill argument array with prefix args first
-                    int arg_idx = 0;
-                    for (size_t i = 0; i < executor->prefix_args_count; i++) {
-                        // printf("prefix[%ld]=%s\n", i, executor->prefix_args[i]);
-                        if (strstr(executor->prefix_args[i], "{LANG}")) {
-                            exec_args[arg_idx] = str_replace_all(executor->prefix_args[i], "{LANG}", block->info);
-                        } else if (strstr(executor->prefix_args[i], "{CODE}")) {
-                            exec_args[arg_idx] = str_replace_all(executor->prefix_args[i], "{CODE}", block->code);
-                        } else {
-                            exec_args[arg_idx] = (char *)executor->prefix_args[i];
-                        }
-                        arg_idx++;
-                    }
+// Name of record for its output: its words, as far as they fit
+static int batch_record_name(BATCH *batch, BATCH_RECORD *record, char *buf, size_t size) {
+    size_t n = 0;
+    for (int i = 0; i < record->argc && n + 1 < size; i++) {
+        int written = snprintf(buf + n, size - n, "%s%s", i ? " " : "", batch->words[record->word + i]);
+        n           = written < 0 ? n : n + (size_t)written < size ? n + (size_t)written : size - 1;
+    }
+    buf[n] = '\0';
+    return (int)n;
+}
 
-                    // Add user arguments
-                    for (int i = 0; i < num_args; i++) {
-                        exec_args[arg_idx++] = args[i];
-                    }
+// Run the records, at most max_jobs at a time
+static int batch_run(BATCH *batch, int max_jobs, int keep_going) {
+    struct sigaction saved[4];
+    int              caught = catch_signals(saved);
+    int              name_width = -1;
+    if (config.output != OUTPUT_RAW && wake_pipe[0] >= 0) {
+        name_width = 0;
+        for (size_t i = 0; i < batch->record_count; i++) {
+            char name[256];
+            int  width = string_width_n(name, (size_t)batch_record_name(batch, &batch->records[i], name, sizeof(name)));
+            name_width = width > name_width ? width : name_width;
+        }
+    }
+
+    size_t next      = 0;
+    int    running   = 0;
+    int    exit_code = 0;
+    int    stopping  = 0;
+    while (1) {
+        while (!stopping && next < batch->record_count && running < max_jobs) {
+            BATCH_RECORD *record = &batch->records[next++];
+            if (name_width >= 0) {
+                char name[256];
+                int  size      = batch_record_name(batch, record, name, sizeof(name));
+                record->output = output_open(name, (size_t)size, name_width);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &record->start);
+            timing_start(&record->spawn);
+            record->pid = name_width >= 0 && !record->output
+                              ? -1
+                              : run_detached(record->node, batch->words + record->word + 1, record->argc - 1,
+                                             record->output ? record->output->child_fds : NULL);
+            timing_start(&record->spawned);
+            if (record->pid > 0) {
+                record->state = JOB_RUNNING;
+                running++;
+                continue;
+            }
+            record->state = JOB_DONE;
+            if (!exit_code) {
+                exit_code = 1;
+            }
+            stopping = !keep_going;
+        }
+        if (running == 0) {
+            break;
+        }
 
-                    exec_args[arg_idx] = NULL;
+        int           status;
+        struct rusage usage;
+        pid_t         pid = wait_output(-1, &status, &usage);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                perror("wait4 failed");
+                break;
+            }
+            if (pending_signal) {
+                log_info("Forwarding signal %d to records\n", (int)pending_signal);
+                for (size_t i = 0; i < batch->record_count; i++) {
+                    if (batch->records[i].state == JOB_RUNNING) {
+                        kill(-batch->records[i].pid, pending_signal);
+                    }
+                }
+                if (!exit_code) {
+                    exit_code = 128 + pending_signal;
+                }
+                stopping       = 1;
+                pending_signal = 0;
+            }
+            continue;
+        }
 
-                    execvp(exec_args[0], exec_args);
-                    perror("execvp failed");
-                    free(exec_args);
-                    _exit(1);
-                } else {
-                    // Parent process
-                    int status;
-                    waitpid(pid, &status, 0);
-
-                    exit_code = WEXITSTATUS(status);
-                    // if (!WIFEXITED(status) || exit_code != 0) {
-                    //     info("Command failed with status %d\n", exit_code);
-                    // } else {
-                    //     info("Command completed successfully %d\n", exit_code);
-                    // }
-                    log_printf("Command exit code: %d\n", exit_code);
+        BATCH_RECORD *record = NULL;
+        for (size_t i = 0; i < batch->record_count && !record; i++) {
+            if (batch->records[i].state == JOB_RUNNING && batch->records[i].pid == pid) {
+                record = &batch->records[i];
+            }
+        }
+        if (!record) {
+            continue;
+        }
+        running--;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        record->state     = JOB_DONE;
+        record->exit_code = status_code(status);
+        record->wall_ms   = elapsed_ms(&record->start, &now);
+        if (timing_enabled()) {
+            char name[256];
+            snprintf(name, sizeof(name), "batch: %zu %s", record->number, batch->words[record->word]);
+            timing_child(name, &record->spawn, &record->spawned, &usage, status);
+        }
+        log_info("Record %zu exit code: %d\n", record->number, record->exit_code);
+        if (record->output) {
+            output_close(record->output);
+        }
+        if (record->exit_code && !stopping) {
+            if (!exit_code) {
+                exit_code = record->exit_code;
+            }
+            if (!keep_going) {
+                stopping = 1;
+                for (size_t i = 0; i < batch->record_count; i++) {
+                    if (batch->records[i].state == JOB_RUNNING) {
+                        kill(-batch->records[i].pid, SIGTERM);
+                    }
                 }
-            } else {
-                error("%s: Unsupported language: %s\n", config.program, lang);
-                return 1;
             }
         }
-        if (exit_code) {
-            break;
+    }
+
+    if (caught) {
+        release_signals(saved);
+    }
+    for (size_t i = 0; i < batch->record_count; i++) {
+        BATCH_RECORD *record = &batch->records[i];
+        if (record->output && record->state == JOB_DONE && record->exit_code && batch->record_count > 1) {
+            output_report(record->output, record->exit_code);
         }
-        block = block->next;
+        free_output(record->output);
+        record->output = NULL;
     }
     return exit_code;
 }
 
-void show_hint(MD_NODE *doc_node) {
-    for (MD_NODE *current = doc_node; current; current = current->next) {
-        int max_branch_width = get_max_branch_width(current);
-
-        Tree *docTree = new_tree(doc_node->text);
-        node_to_tree_with_desc(current, docTree, max_branch_width);
-        char *tree_str = print_tree(docTree);
-        printf("%s", tree_str);
+static void batch_summary(BATCH *batch, FILE *stream) {
+    size_t failed  = 0;
+    size_t skipped = 0;
+    fputs("{\"records\":[", stream);
+    for (size_t i = 0; i < batch->record_count; i++) {
+        BATCH_RECORD *record = &batch->records[i];
+        fprintf(stream, "%s{\"record\":%zu,\"heading\":", i ? "," : "", record->number);
+        print_json_string(batch->words[record->word], stream);
+        fputs(",\"args\":[", stream);
+        for (int j = 1; j < record->argc; j++) {
+            if (j > 1) {
+                putc(',', stream);
+            }
+            print_json_string(batch->words[record->word + j], stream);
+        }
+        if (record->state == JOB_DONE && record->pid > 0) {
+            fprintf(stream, "],\"exit_code\":%d,\"wall_ms\":%.3f}", record->exit_code, record->wall_ms);
+            failed += record->exit_code != 0;
+        } else {
+            fputs("],\"exit_code\":null}", stream);
+            skipped++;
+        }
     }
+    fprintf(stream, "],\"failed\":%zu,\"skipped\":%zu}\n", failed, skipped);
 }
 
-void show_help() {
-    printf("Usage: %s [OPTIONS] [HEADING] [ARGS...]\n"
-           "Options:\n"
-           "  -h, --help              Print this help message\n"
-           "  -c, --code [HEADING]    Print code block\n"
-           "  -1 [HEADING]            List one command per line\n"
-           "  -t, --tree [HEADING]    Print tree with description\n"
-           "  -f, --file [FILE]       Specify the file to parse\n"
-           "  -l, --log-file [FILE]   Path to log file for diagnostics\n",
-           config.program);
+// Run the records of the batch at path, or stdin without one
+int run_batch(const char *path, int max_jobs, int keep_going) {
+    size_t size;
+    char  *buf = read_batch(path, &size);
+    if (!buf) {
+        return 1;
+    }
+    BATCH batch     = {0};
+    int   exit_code = batch_parse(&batch, buf, size) != 0;
+    for (size_t i = 0; i < batch.record_count && !exit_code; i++) {
+        BATCH_RECORD *record = &batch.records[i];
+        if (!(record->node = find_node(&doc, batch.words[record->word]))) {
+            error("Cannot find node: %s (record %zu)\n", batch.words[record->word], record->number);
+            exit_code = 1;
+        }
+    }
+    if (!exit_code) {
+        log_info("Running %zu records, %d at a time\n", batch.record_count, max_jobs);
+        exit_code = batch_run(&batch, max_jobs, keep_going);
+        fflush(stdout);
+        batch_summary(&batch, stderr);
+    }
+    free(batch.words);
+    free(batch.records);
+    free(buf);
+    return exit_code;
 }
 
 int main(int argc, char **argv) {
@@ -912,7 +6437,8 @@ int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
 
 
-    config.program = basename(argv[0]);
+    config.program   = basename(argv[0]);
+    config.log_level = LOG_INFO;
 
     // Parse options
     int argi = 1;
@@ -938,14 +6464,30 @@ int main(int argc, char **argv) {
                         case 't':
                             config.tree = 1;
                             break;
+                        case 'k':
+                            config.keep_going = 1;
+                            break;
+                        case 'j':                                        // Pattern: -j**, -j **
+                            if (short_opt_index < current_arg_len - 1) { // Not the last char
+                                config.jobs = atoi(current_arg + short_opt_index + 1);
+                            } else if (argi < argc - 1 && argv[argi + 1] && argv[argi + 1][0] != '-') {
+                                config.jobs = atoi(argv[argi + 1]);
+                                argi++;
+                            }
+                            if (config.jobs < 1) {
+                                error("No job count specified after -j\n");
+                                return 1;
+                            }
+                            short_opt_index = current_arg_len; // Go to parse next argument
+                            break;
                         case 'f':                                        // Pattern: -f**, -f **
                             if (short_opt_index < current_arg_len - 1) { // Not the last char
-                                config.file_path = current_arg + short_opt_index + 1;
+                                add_file(current_arg + short_opt_index + 1);
                             } else {
                                 // Current argument is not the last argument,
                                 // and next argument is not an option.
                                 if (argi < argc - 1 && argv[argi + 1] && argv[argi + 1][0] != '-') {
-                                    config.file_path = argv[argi + 1];
+                                    add_file(argv[argi + 1]);
                                     argi++;
                                 } else {
                                     error("No file path specified after -f\n");
@@ -982,20 +6524,68 @@ int main(int argc, char **argv) {
                     config.code = 1;
                 } else if (strcmp(current_arg, "--tree") == 0) {
                     config.tree = 1;
+                } else if (strcmp(current_arg, "--no-cache") == 0) {
+                    config.no_cache = 1;
+                } else if (strcmp(current_arg, "--rebuild-cache") == 0) {
+                    config.rebuild_cache = 1;
+                } else if (strcmp(current_arg, "--fast-scan") == 0) {
+                    config.fast_scan = 1;
+                } else if (strcmp(current_arg, "--serve") == 0) {
+                    config.serve = 1;
+                } else if (strcmp(current_arg, "--watch") == 0) {
+                    config.watch = 1;
+                } else if (strncmp(current_arg, "--limits=", 9) == 0) { // Pattern: --limits=**
+                    LIMITS limits = {0};
+                    config.limits = current_arg + 9;
+                    if (parse_limits(str_view(config.limits), &limits) != 0) {
+                        return 1;
+                    }
+                } else if (strncmp(current_arg, "--output=", 9) == 0) { // Pattern: --output=**
+                    if (parse_output(current_arg + 9) != 0) {
+                        return 1;
+                    }
+                } else if (strcmp(current_arg, "--session") == 0) {
+                    config.session = 1;
+                } else if (strcmp(current_arg, "--batch") == 0) {
+                    config.batch = 1;
+                } else if (strncmp(current_arg, "--batch=", 8) == 0 && current_arg_len > 8) { // Pattern: --batch=**
+                    config.batch      = 1;
+                    config.batch_file = current_arg + 8;
+                } else if (strcmp(current_arg, "--complete") == 0 && argi < argc - 1) { // Pattern: --complete N **
+                    // The words to complete are not options of ours
+                    return complete(atoi(argv[argi + 1]), argv + argi + 2, argc - argi - 2);
                 } else if (strncmp(current_arg, "--file=", 7) == 0 && current_arg_len > 7) { // Pattern: --file=**
-                    config.file_path = current_arg + 7;
+                    add_file(current_arg + 7);
                 } else if (strcmp(current_arg, "--file") == 0 && argi < argc - 1) { // Pattern: --file **
                     argi++;
                     if (argv[argi]) {
-                        config.file_path = argv[argi];
+                        add_file(argv[argi]);
                     }
                 } else if (strncmp(current_arg, "--log-file=", 11) == 0 && current_arg_len > 11) { // Pattern: --file=**
-                    config.log_file = current_arg + 7;
+                    config.log_file = current_arg + 11;
                 } else if (strcmp(current_arg, "--log-file") == 0 && argi < argc - 1) { // Pattern: --file **
                     argi++;
                     if (argv[argi]) {
                         config.log_file = argv[argi];
                     }
+                } else if (strncmp(current_arg, "--jobs=", 7) == 0) { // Pattern: --jobs=**
+                    config.jobs = atoi(current_arg + 7);
+                    if (config.jobs < 1) {
+                        error("Invalid job count: %s\n", current_arg + 7);
+                        return 1;
+                    }
+                } else if (strcmp(current_arg, "--keep-going") == 0) {
+                    config.keep_going = 1;
+                } else if (strcmp(current_arg, "--timings") == 0) {
+                    config.timings = TIMING_TEXT;
+                } else if (strcmp(current_arg, "--timings=json") == 0) {
+                    config.timings = TIMING_JSON;
+                } else if (strncmp(current_arg, "--log-level=", 12) == 0) { // Pattern: --log-level=**
+                    config.log_level = log_parse_level(current_arg + 12);
+                    if (config.log_level < 0) {
+                        error("Unknown log level: %s\n", current_arg + 12);
+                        return 1;
+                    }
                 } else {
                     error("Unknown option: %s\n", current_arg);
                     return 1;
@@ -1008,7 +6598,12 @@ int main(int argc, char **argv) {
         argi++;
     }
 
-    log_printf("flags: help=%d, code=%d, one=%d, file_path=%s\n",
+    if (config.log_file) {
+        log_open(config.log_file, config.program, config.log_level);
+    }
+    timing_init(config.timings);
+
+    log_info("flags: help=%d, code=%d, one=%d, file_path=%s\n",
                config.help, config.code, config.one, config.file_path);
 
     if (config.help) {
@@ -1016,82 +6611,134 @@ int main(int argc, char **argv) {
         return EXIT_SUCCESS;
     }
 
+    if (config.serve) {
+        return serve();
+    }
+
+    // A nested cr goes on with the doc of the one running it, without
+    // looking for one
+    const char *inherited_file = getenv("CR_FILE");
+    if (!config.file_path && inherited_file && *inherited_file && access(inherited_file, R_OK) == 0) {
+        config.file_path = (char *)inherited_file;
+    }
+
     // Find and read markdown file
     if (!config.file_path) {
+        TimingMark mark;
+        timing_start(&mark);
         config.file_path = find_doc(config.program);
+        timing_end(&mark, "find_doc");
         fflush(stdout);
     }
 
     if (!config.file_path) {
-        log_printf("No markdown file found\n");
+        log_info("No markdown file found\n");
         fprintf(stderr, "No markdown file found\n");
         return EXIT_FAILURE;
     }
     
     setenv("CR", argv[0], 1);
     setenv("CR_FILE", config.file_path, 1);
-    log_printf("Using doc: %s\n", config.file_path);
-    parse_custom_executors();
+    log_info("Using doc: %s\n", config.file_path);
+
+    // Printing can be served by a daemon, running a heading cannot. The
+    // docs of a workspace are parsed here.
+    const char *heading      = argi < argc ? argv[argi] : NULL;
+    char        mode         = config.code ? 'c' : config.one ? '1' : config.tree || !heading ? 't' : 0;
+    if (config.batch) {
+        if (heading) {
+            error("No heading is taken with --batch: %s\n", heading);
+            return 1;
+        }
+        mode = 0;
+    }
+    int         in_workspace = config.files.gl_pathc > 1;
+    if (mode && !config.no_cache && !config.rebuild_cache && !in_workspace) {
+        int status = serve_client(config.file_path, heading, mode);
+        if (status >= 0) {
+            return status;
+        }
+    }
 
-    MD_NODE *doc_node = parse_file(config.file_path);
+    MD_NODE *doc_node = in_workspace ? load_workspace(config.files.gl_pathv, config.files.gl_pathc)
+                                     : load_doc(config.file_path, &doc, heading);
 
     // Check if parsing was successful
     if (!doc_node) {
-        log_printf("Failed to parse file: %s\n", config.file_path);
+        log_info("Failed to parse file: %s\n", config.file_path);
         fprintf(stderr, "Failed to parse file: %s\n", config.file_path);
         return EXIT_FAILURE;
     }
 
-    if (argi < argc) {
-        // First non-option argument is the node path, everything after that are
-        // arguments to the code
-        char  *cmd      = argv[argi];
-        char **cmd_args = argv + argi + 1;
-        int    num_args = argc - argi - 1;
+    if (mode) {
+        int status = print_doc(&doc, heading, mode);
+        free_workspace();
+        free_doc(&doc);
+        return status;
+    }
 
-        log_printf("Looking for node_path '%s'\n", cmd);
+    // The jobs of a batch are its records
+    if (config.batch) {
+        int max_jobs = config.jobs ? config.jobs : 1;
+        config.jobs  = 0;
+        int status   = run_batch(config.batch_file, max_jobs, config.keep_going);
+        free_workspace();
+        free_doc(&doc);
+        return status;
+    }
 
-        // Find the node using the path (which may contain slashes)
-        // Start search from the first level of children, not the document root
-        MD_NODE *foundNode = NULL;
-        if (doc_node) {
-            foundNode = find_node(doc_node, cmd);
+    // First non-option argument is the node path, everything after that are
+    // arguments to the code
+    char **cmd_args = argv + argi + 1;
+    int    num_args = argc - argi - 1;
+
+    log_info("Looking for node_path '%s'\n", heading);
+    TimingMark mark;
+    timing_start(&mark);
+    MD_NODE *foundNode = find_node(&doc, heading);
+    timing_end(&mark, "find_node");
+    if (!foundNode) {
+        error("Cannot find node: %s\n", heading);
+        return 1;
+    }
+    log_info("Found node: %.*s\n", (int)foundNode->text.size, foundNode->text.text);
+
+    // Deps can be anywhere in the doc, past the end of a partial parse, as
+    // for watch_reload()
+    if (doc.partial && section_has_deps(foundNode)) {
+        log_info("Parsing the whole doc for the deps\n");
+        free_doc(&doc);
+        if (!load_doc(config.file_path, &doc, NULL) || !(foundNode = find_node(&doc, heading))) {
+            error("Cannot find node: %s\n", heading);
+            free_doc(&doc);
+            return 1;
         }
+    }
 
-        if (foundNode) {
-            log_printf("Found node: %s\n", foundNode->text);
-            // foundNode->next  = NULL; // Do not print next node
-            // foundNode->child = NULL; // Do not print child node
+    if (config.watch) {
+        int status = watch(foundNode, heading, cmd_args, num_args);
+        free_workspace();
+        free_doc(&doc);
+        return status;
+    }
 
-            if (config.code) {
-                if (config.code) {
-                    CODE_BLOCK *code_block = foundNode->code_block;
-                    while (code_block) {
-                        printf("%s", code_block->code);
-                        code_block = code_block->next;
-                    }
-                }
-            } else if (config.one) {
-                print_one(foundNode);
-            } else if (config.tree) {
-                print_node_tree_with_desc(foundNode);
-            } else {
-                return exec_node(foundNode, cmd_args, num_args);
-            }
-        } else {
-            error("Cannot find node: %s\n", cmd);
-            return 1;
-        }
+    // A heading of a workspace runs as if its doc was the only one
+    WORKSPACE_DOC *owner = workspace_doc(foundNode);
+    if (owner) {
+        config.file_path = owner->path;
+        setenv("CR_FILE", owner->path, 1);
+        export_snapshot(owner->path, &owner->doc);
     } else {
-        log_printf("No command specified, printing hints.\n");
-        if (config.one) {
-            print_one(doc_node);
-        } else {
-            for (MD_NODE *current = doc_node; current; current = current->next) {
-                print_node_tree_with_desc(current);
-            }
-        }
+        export_snapshot(config.file_path, &doc);
     }
-
-    return 0;
+    int exit_code;
+    if (config.jobs || has_directives(foundNode)) {
+        exit_code = exec_jobs(foundNode, cmd_args, num_args, config.jobs ? config.jobs : 1, config.jobs,
+                              config.keep_going);
+    } else {
+        exit_code = exec_node(foundNode, cmd_args, num_args);
+    }
+    free_workspace();
+    free_doc(&doc);
+    return exit_code;
 }
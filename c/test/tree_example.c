@@ -1,16 +1,20 @@
 #include "../tree/tree.c"
 
 int main() {
-    Tree *root   = new_tree("Root");
-    Tree *child1 = add_node(root, "Child 1");
-    Tree *child2 = add_node(root, "Child 2");
-    add_node(child1, "Grandchild 1");
-    add_node(child2, "Grandchild 2");
+    Tree root;
+    tree_init(&root);
+    tree_root(&root, "Root", 4);
+    tree_add(&root, 0, "Child 1", 7, -1, NULL, 0);
+    tree_push(&root, 0);
+    tree_add(&root, 1, "Grandchild 1", 12, -1, NULL, 0);
+    tree_pop(&root);
+    tree_add(&root, 1, "Child 2", 7, -1, NULL, 0);
+    tree_push(&root, 1);
+    tree_add(&root, 1, "Grandchild 2", 12, -1, NULL, 0);
+    tree_pop(&root);
 
-    char *tree_str = print_tree(root);
-    printf("%s", tree_str);
+    tree_print(&root, stdout);
 
-    free(tree_str);
-    free_tree(root);
+    free_tree(&root);
     return 0;
-}
\ No newline at end of file
+}
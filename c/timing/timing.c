@@ -0,0 +1,231 @@
+#include "timing.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// Phases are recorded as they end, and reported to stderr at exit. They can
+// end on several threads at once, the lock guards the arrays.
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    int          mode;
+    TimingMark   start;
+    TimingPhase *phases;
+    size_t       phase_count;
+    size_t       phase_capacity;
+    TimingCount *counts;
+    size_t       count_count;
+    size_t       count_capacity;
+    TimingChild *children;
+    size_t       child_count;
+    size_t       child_capacity;
+} timing;
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (double)(to->tv_sec - from->tv_sec) * 1e3 + (double)(to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+    return (double)tv->tv_sec * 1e3 + (double)tv->tv_usec / 1e3;
+}
+
+// Grow *items to hold one more element of size bytes
+static int reserve_one(void **items, size_t count, size_t *capacity, size_t size) {
+    if (count < *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    void  *new_items    = realloc(*items, new_capacity * size);
+    if (!new_items) {
+        return -1;
+    }
+    *items    = new_items;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Enable timings and report them in mode at exit
+void timing_init(int mode) {
+    timing.mode = mode;
+    if (mode != TIMING_OFF) {
+        timing_start(&timing.start);
+        atexit(timing_report);
+    }
+}
+
+int timing_enabled(void) {
+    return timing.mode != TIMING_OFF;
+}
+
+void timing_start(TimingMark *mark) {
+    if (!timing_enabled()) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &mark->cpu);
+}
+
+// Record the phase started at mark
+void timing_end(TimingMark *mark, const char *name) {
+    if (!timing_enabled()) {
+        return;
+    }
+    TimingMark now;
+    timing_start(&now);
+    pthread_mutex_lock(&timing_lock);
+    if (reserve_one((void **)&timing.phases, timing.phase_count, &timing.phase_capacity, sizeof(TimingPhase)) == 0) {
+        TimingPhase *phase = &timing.phases[timing.phase_count];
+        phase->name        = strdup(name);
+        if (phase->name) {
+            phase->wall_ms = elapsed_ms(&mark->wall, &now.wall);
+            phase->cpu_ms  = elapsed_ms(&mark->cpu, &now.cpu);
+            timing.phase_count++;
+        }
+    }
+    pthread_mutex_unlock(&timing_lock);
+}
+
+// Record count under name
+void timing_count(const char *name, long count) {
+    if (!timing_enabled()) {
+        return;
+    }
+    pthread_mutex_lock(&timing_lock);
+    if (reserve_one((void **)&timing.counts, timing.count_count, &timing.count_capacity, sizeof(TimingCount)) == 0) {
+        TimingCount *entry = &timing.counts[timing.count_count];
+        entry->name        = strdup(name);
+        if (entry->name) {
+            entry->count = count;
+            timing.count_count++;
+        }
+    }
+    pthread_mutex_unlock(&timing_lock);
+}
+
+// Record a child spawned at spawn, whose spawn call returned at spawned, and
+// that has just been reaped with usage
+void timing_child(const char *name, TimingMark *spawn, TimingMark *spawned, const struct rusage *usage, int status) {
+    if (!timing_enabled()) {
+        return;
+    }
+    TimingMark now;
+    timing_start(&now);
+    if (reserve_one((void **)&timing.children, timing.child_count, &timing.child_capacity, sizeof(TimingChild)) != 0) {
+        return;
+    }
+    TimingChild *child = &timing.children[timing.child_count];
+    child->name        = strdup(name);
+    if (!child->name) {
+        return;
+    }
+    child->spawn_ms   = elapsed_ms(&spawn->wall, &spawned->wall);
+    child->run_ms     = elapsed_ms(&spawn->wall, &now.wall);
+    child->user_ms    = timeval_ms(&usage->ru_utime);
+    child->sys_ms     = timeval_ms(&usage->ru_stime);
+    child->max_rss_kb = usage->ru_maxrss;
+    child->status     = status;
+    timing.child_count++;
+}
+
+static void print_json_string(const char *str, FILE *stream) {
+    putc('"', stream);
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(stream, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(stream, "\\u%04x", *c);
+        } else {
+            putc(*c, stream);
+        }
+    }
+    putc('"', stream);
+}
+
+// Exit code of a child, or 128 + signal as a shell reports it
+static int status_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+static void report_text(TimingMark *end, FILE *stream) {
+    fprintf(stream, "%-32s %10s %10s\n", "phase", "wall ms", "cpu ms");
+    for (size_t i = 0; i < timing.phase_count; i++) {
+        TimingPhase *phase = &timing.phases[i];
+        fprintf(stream, "%-32s %10.3f %10.3f\n", phase->name, phase->wall_ms, phase->cpu_ms);
+    }
+    if (timing.count_count) {
+        fprintf(stream, "%-32s %10s\n", "count", "value");
+        for (size_t i = 0; i < timing.count_count; i++) {
+            fprintf(stream, "%-32s %10ld\n", timing.counts[i].name, timing.counts[i].count);
+        }
+    }
+    if (timing.child_count) {
+        fprintf(stream, "%-32s %10s %10s %10s %10s %10s %6s\n", "child", "spawn ms", "run ms", "user ms", "sys ms",
+                "rss KB", "status");
+        for (size_t i = 0; i < timing.child_count; i++) {
+            TimingChild *child = &timing.children[i];
+            fprintf(stream, "%-32s %10.3f %10.3f %10.3f %10.3f %10ld %6d\n", child->name, child->spawn_ms, child->run_ms,
+                    child->user_ms, child->sys_ms, child->max_rss_kb, status_code(child->status));
+        }
+    }
+    fprintf(stream, "%-32s %10.3f %10.3f\n", "total", elapsed_ms(&timing.start.wall, &end->wall),
+            elapsed_ms(&timing.start.cpu, &end->cpu));
+}
+
+static void report_json(TimingMark *end, FILE *stream) {
+    fputs("{\"phases\":[", stream);
+    for (size_t i = 0; i < timing.phase_count; i++) {
+        TimingPhase *phase = &timing.phases[i];
+        fputs(i ? ",{\"name\":" : "{\"name\":", stream);
+        print_json_string(phase->name, stream);
+        fprintf(stream, ",\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", phase->wall_ms, phase->cpu_ms);
+    }
+    fputs("],\"counts\":[", stream);
+    for (size_t i = 0; i < timing.count_count; i++) {
+        fputs(i ? ",{\"name\":" : "{\"name\":", stream);
+        print_json_string(timing.counts[i].name, stream);
+        fprintf(stream, ",\"count\":%ld}", timing.counts[i].count);
+    }
+    fputs("],\"children\":[", stream);
+    for (size_t i = 0; i < timing.child_count; i++) {
+        TimingChild *child = &timing.children[i];
+        fputs(i ? ",{\"name\":" : "{\"name\":", stream);
+        print_json_string(child->name, stream);
+        fprintf(stream,
+                ",\"spawn_ms\":%.3f,\"run_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld,\"status\":%d}",
+                child->spawn_ms, child->run_ms, child->user_ms, child->sys_ms, child->max_rss_kb,
+                status_code(child->status));
+    }
+    fprintf(stream, "],\"total\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}}\n", elapsed_ms(&timing.start.wall, &end->wall),
+            elapsed_ms(&timing.start.cpu, &end->cpu));
+}
+
+// Print the recorded timings to stderr
+void timing_report(void) {
+    if (!timing_enabled()) {
+        return;
+    }
+    TimingMark end;
+    timing_start(&end);
+    if (timing.mode == TIMING_JSON) {
+        report_json(&end, stderr);
+    } else {
+        report_text(&end, stderr);
+    }
+
+    for (size_t i = 0; i < timing.phase_count; i++) {
+        free(timing.phases[i].name);
+    }
+    for (size_t i = 0; i < timing.count_count; i++) {
+        free(timing.counts[i].name);
+    }
+    for (size_t i = 0; i < timing.child_count; i++) {
+        free(timing.children[i].name);
+    }
+    free(timing.phases);
+    free(timing.counts);
+    free(timing.children);
+    timing.mode = TIMING_OFF;
+}
@@ -0,0 +1,51 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define TIMING_OFF  0
+#define TIMING_TEXT 1
+#define TIMING_JSON 2
+
+// Start of a measured phase
+typedef struct TimingMark {
+    struct timespec wall;
+    struct timespec cpu;
+} TimingMark;
+
+// A phase of cr itself
+typedef struct TimingPhase {
+    char  *name;
+    double wall_ms;
+    double cpu_ms;
+} TimingPhase;
+
+// A child process run for a code block
+typedef struct TimingChild {
+    char  *name;
+    double spawn_ms; // Until the spawn call returned in the parent
+    double run_ms;   // From the spawn call until the child was reaped
+    double user_ms;
+    double sys_ms;
+    long   max_rss_kb;
+    int    status; // Raw wait status
+} TimingChild;
+
+// A number counted during a phase, such as syscalls made
+typedef struct TimingCount {
+    char *name;
+    long  count;
+} TimingCount;
+
+// Function prototypes
+void timing_init(int mode);
+int  timing_enabled(void);
+void timing_start(TimingMark *mark);
+void timing_end(TimingMark *mark, const char *name);
+void timing_count(const char *name, long count);
+void timing_child(const char *name, TimingMark *spawn, TimingMark *spawned, const struct rusage *usage, int status);
+void timing_report(void);
+
+#endif /* TIMING_H */
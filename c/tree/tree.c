@@ -8,104 +8,143 @@ const char *CONTINUE_ITEM = "│   ";
 const char *LAST_ITEM     = "└── ";
 
 // Internal function prototypes
-static char *print_items(Tree *items[], int count, int spaces[], int space_count);
-static char *print_text(const char *text, int spaces[], int space_count, int last);
-static char *create_string_buffer(size_t size);
-
-// Create a new tree node
-Tree *new_tree(const char *text) {
-    Tree *t = (Tree *)malloc(sizeof(Tree));
-    strncpy(t->text, text, MAX_TEXT_LENGTH - 1);
-    t->text[MAX_TEXT_LENGTH - 1] = '\0';
-    t->item_count                = 0;
-    return t;
-}
-
-// Add a new node to the tree
-Tree *add_node(Tree *t, const char *text) {
-    if (t->item_count >= MAX_CHILDREN)
-        return NULL;
-    Tree *child               = new_tree(text);
-    t->items[t->item_count++] = child;
-    return child;
+static int  reserve_text(Tree *t, size_t size);
+static void append_text(Tree *t, const char *text, size_t size);
+static char *add_row(Tree *t, const char *indicator, const char *text, size_t size, int width,
+                     const char *description, size_t description_size);
+
+// Initialize an empty tree
+void tree_init(Tree *t) {
+    memset(t, 0, sizeof(*t));
 }
 
-// Add an existing tree as a subtree
-void add_subtree(Tree *t, Tree *subtree) {
-    if (t->item_count >= MAX_CHILDREN)
-        return;
-    t->items[t->item_count++] = subtree;
+// Make room for size more bytes of text
+static int reserve_text(Tree *t, size_t size) {
+    if (t->text_size + size <= t->text_capacity) {
+        return 0;
+    }
+    size_t capacity = t->text_capacity ? t->text_capacity : 4096;
+    while (capacity < t->text_size + size) {
+        capacity *= 2;
+    }
+    char *text = realloc(t->text, capacity);
+    if (!text) {
+        return -1;
+    }
+    t->text          = text;
+    t->text_capacity = capacity;
+    return 0;
 }
 
-// Helper function to create a string buffer
-static char *create_string_buffer(size_t size) {
-    return (char *)malloc(size);
+// Append to the text, which must have been reserved
+static void append_text(Tree *t, const char *text, size_t size) {
+    memcpy(t->text + t->text_size, text, size);
+    t->text_size += size;
 }
 
-// Print tree to string
-char *print_tree(Tree *t) {
-    char *result = create_string_buffer(MAX_TEXT_LENGTH * 100); // Arbitrary size
-    char *temp   = create_string_buffer(MAX_TEXT_LENGTH * 100);
-
-    strcpy(result, t->text);
-    strcat(result, NEW_LINE);
+// Add a row made of the current indentation, indicator and text. Returns the
+// copy of text, valid until the next row is added, or NULL if out of memory.
+static char *add_row(Tree *t, const char *indicator, const char *text, size_t size, int width,
+                     const char *description, size_t description_size) {
+    if (t->row_count == t->row_capacity) {
+        size_t   capacity = t->row_capacity ? t->row_capacity * 2 : 64;
+        TreeRow *rows     = realloc(t->rows, capacity * sizeof(*rows));
+        if (!rows) {
+            return NULL;
+        }
+        t->rows         = rows;
+        t->row_capacity = capacity;
+    }
 
-    int   spaces[100] = {0}; // For tracking vertical lines
-    char *items_str   = print_items(t->items, t->item_count, spaces, 0);
-    strcat(result, items_str);
+    size_t indent_size = 0;
+    for (int i = 0; i < t->depth; i++) {
+        indent_size += strlen(t->lasts[i] ? EMPTY_SPACE : CONTINUE_ITEM);
+    }
+    size_t indicator_size = indicator ? strlen(indicator) : 0;
+    if (reserve_text(t, indent_size + indicator_size + size) != 0) {
+        return NULL;
+    }
 
-    free(items_str);
-    free(temp);
-    return result;
+    TreeRow *row = &t->rows[t->row_count++];
+    row->offset  = t->text_size;
+    for (int i = 0; i < t->depth; i++) {
+        const char *space = t->lasts[i] ? EMPTY_SPACE : CONTINUE_ITEM;
+        append_text(t, space, strlen(space));
+    }
+    if (indicator) {
+        append_text(t, indicator, indicator_size);
+    }
+    char *copy = t->text + t->text_size;
+    append_text(t, text, size);
+    row->size             = t->text_size - row->offset;
+    row->width            = width;
+    row->description      = description;
+    row->description_size = description_size;
+
+    if (width > t->width) {
+        t->width = width;
+    }
+    return copy;
 }
 
-// Print items recursively
-static char *print_items(Tree *items[], int count, int spaces[], int space_count) {
-    char *result = create_string_buffer(MAX_TEXT_LENGTH * 100);
-    result[0]    = '\0';
+// Add the root line of the tree
+char *tree_root(Tree *t, const char *text, size_t size) {
+    return add_row(t, NULL, text, size, -1, NULL, 0);
+}
 
-    for (int i = 0; i < count; i++) {
-        int   last     = (i == count - 1);
-        char *text_str = print_text(items[i]->text, spaces, space_count, last);
-        strcat(result, text_str);
-        free(text_str);
+// Add an item at the current depth. Items with a width >= 0 get their
+// description aligned after the widest label of the tree.
+char *tree_add(Tree *t, int last, const char *text, size_t size, int width, const char *description,
+               size_t description_size) {
+    return add_row(t, last ? LAST_ITEM : MIDDLE_ITEM, text, size, width, description, description_size);
+}
 
-        if (items[i]->item_count > 0) {
-            int new_spaces[100];
-            memcpy(new_spaces, spaces, sizeof(int) * space_count);
-            new_spaces[space_count] = last;
-            char *items_str         = print_items(items[i]->items, items[i]->item_count,
-                                                  new_spaces, space_count + 1);
-            strcat(result, items_str);
-            free(items_str);
+// Descend into the children of the item just added
+int tree_push(Tree *t, int last) {
+    if (t->depth == t->depth_capacity) {
+        int   capacity = t->depth_capacity ? t->depth_capacity * 2 : 16;
+        char *lasts    = realloc(t->lasts, capacity);
+        if (!lasts) {
+            return -1;
         }
+        t->lasts          = lasts;
+        t->depth_capacity = capacity;
     }
-
-    return result;
+    t->lasts[t->depth++] = (char)last;
+    return 0;
 }
 
-// Print text with proper indentation and symbols
-static char *print_text(const char *text, int spaces[], int space_count, int last) {
-    char *result = create_string_buffer(MAX_TEXT_LENGTH * 100);
-    result[0]    = '\0';
-
-    for (int i = 0; i < space_count; i++) {
-        strcat(result, spaces[i] ? EMPTY_SPACE : CONTINUE_ITEM);
+// Go back to the parent depth
+void tree_pop(Tree *t) {
+    if (t->depth > 0) {
+        t->depth--;
     }
+}
 
-    const char *indicator = last ? LAST_ITEM : MIDDLE_ITEM;
-    strcat(result, indicator);
-    strcat(result, text);
-    strcat(result, NEW_LINE);
-
-    return result;
+// Write the tree to stream
+void tree_print(Tree *t, FILE *stream) {
+    for (size_t i = 0; i < t->row_count; i++) {
+        TreeRow *row = &t->rows[i];
+        fwrite(t->text + row->offset, 1, row->size, stream);
+        if (row->width >= 0) {
+            putc(' ', stream);
+            for (int pad = t->width - row->width; pad > 0; pad--) {
+                putc(' ', stream);
+            }
+            putc(' ', stream);
+            if (row->description) {
+                fwrite(row->description, 1, row->description_size, stream);
+            }
+        }
+        fputs(NEW_LINE, stream);
+    }
 }
 
 // Free tree memory
 void free_tree(Tree *t) {
     if (!t) return;
-    for (int i = 0; i < t->item_count; i++) {
-        free_tree(t->items[i]);
-    }
-    free(t);
-}
\ No newline at end of file
+    free(t->text);
+    free(t->rows);
+    free(t->lasts);
+    tree_init(t);
+}
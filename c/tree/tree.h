@@ -5,22 +5,41 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_CHILDREN          100
-#define MAX_TEXT_LENGTH       1024
 #define TREE_ITEM_RUNE_LENGTH 4
 
-// Tree structure
+// A line of the tree, stored in Tree.text
+typedef struct TreeRow {
+    size_t      offset;
+    size_t      size;
+    int         width;       // Display width of the label, or -1 for no column
+    const char *description; // Not copied, must outlive the tree
+    size_t      description_size;
+} TreeRow;
+
+// Tree being rendered. Rows are added in display order while walking the
+// source tree once; labels with a width are padded into one column when the
+// tree is printed.
 typedef struct Tree {
-    char         text[MAX_TEXT_LENGTH];
-    struct Tree *items[MAX_CHILDREN];
-    int          item_count;
+    char    *text;
+    size_t   text_size;
+    size_t   text_capacity;
+    TreeRow *rows;
+    size_t   row_count;
+    size_t   row_capacity;
+    char    *lasts; // Whether the item at each depth was the last one
+    int      depth;
+    int      depth_capacity;
+    int      width;
 } Tree;
 
 // Function prototypes
-Tree *new_tree(const char *text);
-Tree *add_node(Tree *t, const char *text);
-void  add_subtree(Tree *t, Tree *subtree);
-char *print_tree(Tree *t);
+void  tree_init(Tree *t);
+char *tree_root(Tree *t, const char *text, size_t size);
+char *tree_add(Tree *t, int last, const char *text, size_t size, int width, const char *description,
+               size_t description_size);
+int   tree_push(Tree *t, int last);
+void  tree_pop(Tree *t);
+void  tree_print(Tree *t, FILE *stream);
 void  free_tree(Tree *t);
 
-#endif /* TREE_H */
\ No newline at end of file
+#endif /* TREE_H */
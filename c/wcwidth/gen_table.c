@@ -0,0 +1,63 @@
+/**
+ * gen_table.c
+ *
+ * Print wcwidth_table.h, the two-level lookup table of wcwidth() and
+ * wcwidth_cjk() below WCWIDTH_TABLE_LIMIT, from their interval tables.
+ * Run `make table` after changing those.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#define WCWIDTH_NO_TABLE
+#include "wcwidth.c"
+
+#define LIMIT 0x30000
+#define SHIFT 7
+#define BLOCK (1 << SHIFT)
+
+static unsigned char blocks[LIMIT / BLOCK][BLOCK];
+static unsigned char stage1[LIMIT / BLOCK];
+
+int
+main(void) {
+  int block_count = 0;
+  int i, j;
+
+  for (i = 0; i < LIMIT / BLOCK; i++) {
+    unsigned char block[BLOCK];
+    for (j = 0; j < BLOCK; j++) {
+      wchar_t ucs = (wchar_t) (i * BLOCK + j);
+      block[j] = (unsigned char) ((wcwidth_bisearch(ucs) + 1)
+        | (wcwidth_cjk_bisearch(ucs) + 1) << 4);
+    }
+    for (j = 0; j < block_count && memcmp(blocks[j], block, BLOCK); j++)
+      ;
+    if (j == block_count)
+      memcpy(blocks[block_count++], block, BLOCK);
+    stage1[i] = (unsigned char) j;
+  }
+  if (block_count > 256) {
+    fprintf(stderr, "too many blocks: %d\n", block_count);
+    return 1;
+  }
+
+  printf("/* Generated by gen_table.c, do not edit. */\n");
+  printf("#ifndef WCWIDTH_TABLE_H\n#define WCWIDTH_TABLE_H 1\n\n");
+  printf("/* Each entry is wcwidth() + 1 in the low nibble and wcwidth_cjk() + 1\n"
+         " * in the high one, for code points below WCWIDTH_TABLE_LIMIT. */\n");
+  printf("#define WCWIDTH_TABLE_LIMIT 0x%X\n", LIMIT);
+  printf("#define WCWIDTH_TABLE_SHIFT %d\n\n", SHIFT);
+  printf("static const unsigned char wcwidth_stage1[%d] = {", LIMIT / BLOCK);
+  for (i = 0; i < LIMIT / BLOCK; i++)
+    printf("%s%d,", i % 16 ? " " : "\n  ", stage1[i]);
+  printf("\n};\n\n");
+  printf("static const unsigned char wcwidth_stage2[%d][%d] = {\n", block_count, BLOCK);
+  for (i = 0; i < block_count; i++) {
+    printf("  {");
+    for (j = 0; j < BLOCK; j++)
+      printf("%s0x%02X,", j % 16 ? " " : "\n    ", blocks[i][j]);
+    printf("\n  },\n");
+  }
+  printf("};\n\n#endif\n");
+  return 0;
+}
@@ -20,6 +20,70 @@ TEST (wcwidth) {
   assert(26 == string_width_cjk("こ★ん■に●ち▲わ☆世◆界"));
 }
 
+TEST (table) {
+  long ucs;
+  for (ucs = 0; ucs <= 0x10ffff; ucs++) {
+    assert(wcwidth((wchar_t) ucs) == wcwidth_bisearch((wchar_t) ucs));
+    assert(wcwidth_cjk((wchar_t) ucs) == wcwidth_cjk_bisearch((wchar_t) ucs));
+  }
+}
+
+TEST (ascii) {
+  assert(40 == string_width("build/build:c:release and a long heading"));
+  assert(40 == string_width_n("build/build:c:release and a long heading!", 40));
+  assert(35 == string_width("build/build:c:release\tand a long text"));
+  assert(35 == string_width("build/build:c:release and 世界 text"));
+  assert(38 == string_width_cjk("build/build:c:release ★ and 世界 text"));
+}
+
+/* string_width_n() as it was before the table and the ASCII fast path,
+ * for well-formed UTF-8 */
+static int
+reference_width_n(const char* str, size_t len, int cjk) {
+  const unsigned char* p = (const unsigned char*) str;
+  const unsigned char* end = p + len;
+  int width = 0;
+  while (p < end) {
+    long ucs = *p;
+    int n = *p < 0x80 ? 1 : *p < 0xe0 ? 2 : *p < 0xf0 ? 3 : 4;
+    int i;
+    if (n > 1)
+      ucs &= 0x3f >> (n - 1);
+    for (i = 1; i < n; i++)
+      ucs = (ucs << 6) | (p[i] & 0x3f);
+    width += cjk ? wcwidth_cjk_bisearch((wchar_t) ucs) : wcwidth_bisearch((wchar_t) ucs);
+    p += n;
+  }
+  return width;
+}
+
+static void
+bench(const char* name, const char* str) {
+  const int iterations = 200000;
+  size_t len = strlen(str);
+  volatile int sink = 0;
+  clock_t start;
+  double reference, current;
+  int i;
+
+  assert(reference_width_n(str, len, 0) == string_width_n(str, len));
+  assert(reference_width_n(str, len, 1) == string_width_cjk_n(str, len));
+
+  start = clock();
+  for (i = 0; i < iterations; i++)
+    sink += reference_width_n(str, len, 0);
+  reference = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  start = clock();
+  for (i = 0; i < iterations; i++)
+    sink += string_width_n(str, len);
+  current = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  printf("  %-8s %8.1f ns  %8.1f ns  (bisearch, table)\n", name,
+    reference * 1e9 / iterations, current * 1e9 / iterations);
+  (void) sink;
+}
+
 int
 main () {
   clock_t start = clock();
@@ -27,6 +91,13 @@ main () {
   printf("\n");
 
   RUN_TEST(wcwidth);
+  RUN_TEST(table);
+  RUN_TEST(ascii);
+
+  printf("\n");
+  bench("ascii", "build:c:release    Build C version for Release with zig cc");
+  bench("cjk", "构建发布版本　使用ｚｉｇ编译Ｃ版本　こんにちわ世界　안녕하세요");
+  bench("mixed", "build:c:release    构建 C 版本的发布版本 with zig cc 世界");
 
   printf("\n  %d tests passed in %.5fs\n\n"
     , test_count
@@ -1,5 +1,13 @@
 #include "wcwidth.h"
 #include <string.h>
+#ifndef WCWIDTH_NO_TABLE
+#include "wcwidth_table.h"
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 struct interval
 {
@@ -27,8 +35,10 @@ bisearch(wchar_t ucs, const struct interval *table, int max) {
   return 0;
 }
 
+/* wcwidth() by binary search in the interval tables, which
+ * wcwidth_table.h is generated from */
 int
-wcwidth(wchar_t ucs) {
+wcwidth_bisearch(wchar_t ucs) {
   /* sorted list of non-overlapping intervals of non-spacing characters */
   static const struct interval combining[] = {
     { 0x0300, 0x034E }, { 0x0360, 0x0362 }, { 0x0483, 0x0486 },
@@ -98,6 +108,16 @@ wcwidth(wchar_t ucs) {
     ));
 }
 
+int
+wcwidth(wchar_t ucs) {
+#ifndef WCWIDTH_NO_TABLE
+  if ((unsigned long) ucs < WCWIDTH_TABLE_LIMIT)
+    return (wcwidth_stage2[wcwidth_stage1[ucs >> WCWIDTH_TABLE_SHIFT]]
+      [ucs & ((1 << WCWIDTH_TABLE_SHIFT) - 1)] & 0x0f) - 1;
+#endif
+  return wcwidth_bisearch(ucs);
+}
+
 int
 wcswidth(const wchar_t *pwcs, size_t n) {
   int w, width = 0;
@@ -112,7 +132,7 @@ wcswidth(const wchar_t *pwcs, size_t n) {
 }
 
 int
-wcwidth_cjk(wchar_t ucs) {
+wcwidth_cjk_bisearch(wchar_t ucs) {
   /* sorted list of non-overlapping intervals of East Asian Ambiguous
    * characters */
   static const struct interval ambiguous[] = {
@@ -176,7 +196,17 @@ wcwidth_cjk(wchar_t ucs) {
          sizeof(ambiguous) / sizeof(struct interval) - 1))
     return 2;
 
-  return wcwidth(ucs);
+  return wcwidth_bisearch(ucs);
+}
+
+int
+wcwidth_cjk(wchar_t ucs) {
+#ifndef WCWIDTH_NO_TABLE
+  if ((unsigned long) ucs < WCWIDTH_TABLE_LIMIT)
+    return (wcwidth_stage2[wcwidth_stage1[ucs >> WCWIDTH_TABLE_SHIFT]]
+      [ucs & ((1 << WCWIDTH_TABLE_SHIFT) - 1)] >> 4) - 1;
+#endif
+  return wcwidth_cjk_bisearch(ucs);
 }
 
 int
@@ -252,11 +282,55 @@ utf_ptr2len(const char* str) {
   return len;
 }
 
+/* Length of the printable ASCII at the start of the len bytes of str, one
+ * column per byte in both widths. Checked 16 bytes at a time where SSE2 or
+ * NEON is available. */
+static size_t
+ascii_prefix(const char* str, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i below = _mm_set1_epi8(0x1f);
+  const __m128i above = _mm_set1_epi8(0x7f);
+  for (; i + 16 <= len; i += 16) {
+    /* Bytes from 0x80 are negative, so they fail the first test */
+    __m128i v = _mm_loadu_si128((const __m128i*) (str + i));
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, below),
+      _mm_cmplt_epi8(v, above));
+    if (_mm_movemask_epi8(printable) != 0xffff)
+      break;
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t*) (str + i));
+    if (vminvq_u8(v) < 0x20 || vmaxvq_u8(v) > 0x7e)
+      break;
+  }
+#endif
+  while (i < len && (unsigned char) str[i] >= 0x20
+      && (unsigned char) str[i] < 0x7f)
+    i++;
+  return i;
+}
+
+/* Width of the first len bytes of str, which need not be NUL-terminated.
+ * A sequence truncated by len counts byte by byte. */
 int
-string_width(const char* str) {
-  const char* end = str + strlen(str);
+string_width_n(const char* str, size_t len) {
+  const char* end = str + len;
   int width = 0;
   while(str < end) {
+    if ((unsigned char) *str < 0x80) {
+      size_t ascii = ascii_prefix(str, (size_t) (end - str));
+      if (ascii) {
+        width += (int) ascii;
+        str += ascii;
+        continue;
+      }
+    }
+    if (end - str < utf8len_tab[(unsigned char) *str]) {
+      width += wcwidth((unsigned char) *str++);
+      continue;
+    }
     width += wcwidth(utf_bytes2char((unsigned char*) str));
     str += utf_ptr2len(str);
   }
@@ -264,12 +338,34 @@ string_width(const char* str) {
 }
 
 int
-string_width_cjk(const char* str) {
-  const char* end = str + strlen(str);
+string_width_cjk_n(const char* str, size_t len) {
+  const char* end = str + len;
   int width = 0;
   while(str < end) {
+    if ((unsigned char) *str < 0x80) {
+      size_t ascii = ascii_prefix(str, (size_t) (end - str));
+      if (ascii) {
+        width += (int) ascii;
+        str += ascii;
+        continue;
+      }
+    }
+    if (end - str < utf8len_tab[(unsigned char) *str]) {
+      width += wcwidth_cjk((unsigned char) *str++);
+      continue;
+    }
     width += wcwidth_cjk(utf_bytes2char((unsigned char*) str));
     str += utf_ptr2len(str);
   }
   return width;
 }
+
+int
+string_width(const char* str) {
+  return string_width_n(str, strlen(str));
+}
+
+int
+string_width_cjk(const char* str) {
+  return string_width_cjk_n(str, strlen(str));
+}
@@ -10,10 +10,14 @@
  */
 
 int wcwidth(wchar_t);
+int wcwidth_bisearch(wchar_t);
 int wcswidth(const wchar_t*, size_t);
 int wcwidth_cjk(wchar_t);
+int wcwidth_cjk_bisearch(wchar_t);
 int wcswidth_cjk(const wchar_t*, size_t);
 int string_width(const char*);
 int string_width_cjk(const char*);
+int string_width_n(const char*, size_t);
+int string_width_cjk_n(const char*, size_t);
 
 #endif
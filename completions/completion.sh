@@ -24,102 +24,38 @@
 # To enable Bash completion in your shell, make sure to include the following lines in your $(.bashrc) or $(.bash_profile):
 
 _cr() {
-    _log_write() {
-        printf "%s\n" "$*" >>"${TMPDIR-/tmp}/a.log"
-    }
-
-    _log_write "---------------------------------------------"
-
-    COMPREPLY=()                             # Reset the COMPREPLY array
-    local cur=${COMP_WORDS[COMP_CWORD]}      # Current word
-    local prev=${COMP_WORDS[COMP_CWORD - 1]} # Previous word
-    local builtinOpts="-h --help -f --file -c --code -1 -t --tree -l --log-file"
-    local mdCmds=$(cr -1)
-    local mdHeadings=$(cr -t | grep -Eo '(├──|└──).+  ' | cut -d ' ' -f2-)
-
-    _log_write cur=$cur
-    _log_write prev=$prev
-
-    if test ${COMP_CWORD} -eq 1; then
-        _log_write 0 args
-        COMPREPLY=($(compgen -W "${builtinOpts} ${mdCmds}" -- ${cur}))
-    else
-        local i=1
-        local fileOpt
-        local logFileOpt
-        local skipFile=0
-        while test $i -le ${COMP_CWORD}; do
-            _log_write arg[$i]=${COMP_WORDS[i]}
-
-            case "${COMP_WORDS[i]}" in
-            -h | --help)
-                _log_write is_help
-                ;;
-            -c | --code)
-                _log_write is_code
-                COMPREPLY=($(compgen -W "${mdCmds}" -- "${cur}"))
-                ;;
-            -t | --tree)
-                _log_write is_tree
-                COMPREPLY=($(compgen -W "${mdHeadings}" -- "${cur}"))
-                ;;
-            -1)
-                _log_write is_one
-                COMPREPLY=($(compgen -W "${mdCmds}" -- "${cur}"))
-                ;;
-            -f | --file)
-                COMPREPLY=($(compgen -f -- "${cur}"))
-                fileOpt=$(eval echo "${COMP_WORDS[$((i + 1))]}")
-                _log_write arg[$((i + 1))]=${fileOpt}
-
-                if test -f "${fileOpt}"; then
-                    mdCmds=$(cr -1 -f "${fileOpt}")
-                    mdHeadings=$(cr -t -f "${fileOpt}" | grep -Eo '(├──|└──).+  ' | cut -d ' ' -f2-)
-                fi
-
-                skipFile=1
-                i=$((i + 1))
-                ;;
-            -l | --log-file)
-                COMPREPLY=($(compgen -f -- "${cur}"))
-                logFileOpt=$(eval echo "${COMP_WORDS[$((i + 1))]}")
-                _log_write logFileOpt=${logFileOpt}
-
-                skipFile=1
-                i=$((i + 1))
-                ;;
-            *)
-                if test ${skipFile} -eq 1; then
-                    COMPREPLY=($(compgen -W "${builtinOpts} ${mdCmds}" -- "${cur}"))
-                    skipFile=0
-                else
-                    local lastArg=$(echo ${COMP_LINE} | grep -o '[^ ]*$')
-                    _log_write :lastArg=$lastArg
-
-                    case ${lastArg} in
-                    *:*)
-                        case ${cur} in
-                        :)
-                            COMPREPLY=($(compgen -W "${mdCmds}" -- ${lastArg} | sed "s/${lastArg}//g"))
-                            ;;
-                        '')
-                            COMPREPLY=()
-                            ;;
-                        *)
-                            COMPREPLY=($(compgen -W "${mdCmds}" -- ${lastArg} | sed "s/${lastArg}/${cur}/g"))
-                            ;;
-                        esac
-                        ;;
-                    esac
-                fi
-                _log_write [\*]COMPREPLY=$COMPREPLY
-                ;;
-            esac
-
-            i=$((i + 1))
-        done
-    fi
+    # Words up to the cursor, not split at COMP_WORDBREAKS, so that headings
+    # like build:c stay whole
+    local line=${COMP_LINE:0:COMP_POINT}
+    local words
+    read -ra words <<<"${line}"
+    case "${line}" in
+    *' ') words+=("") ;;
+    esac
+    local cword=$((${#words[@]} - 1))
+    local cur=${words[cword]}
+
+    # One run of cr prints the candidates, one per line
+    local IFS=$'\n'
+    COMPREPLY=($("${words[0]}" --complete "${cword}" "${words[@]}" 2>/dev/null))
+
+    # Bash replaces only the part of cur after the last word break
+    case "${cur}" in
+    *:*)
+        case "${COMP_WORDBREAKS}" in
+        *:*)
+            local colon_word=${cur%"${cur##*:}"}
+            COMPREPLY=("${COMPREPLY[@]#"${colon_word}"}")
+            ;;
+        esac
+        ;;
+    esac
+
+    # Go on completing into dirs and heading paths
+    case "${COMPREPLY[*]}" in
+    */) compopt -o nospace 2>/dev/null ;;
+    esac
 }
 
 # Register the completion function
-complete -o default -F _cr -o nospace cr
+complete -o default -F _cr cr